@@ -0,0 +1,71 @@
+import serial, struct, sys, zlib
+import serial.tools.list_ports
+
+# Differential NAND reflash: only erase blocks whose CRC32 on the console
+# differs from the image get rewritten.
+#
+# usage: flash_diff.py image.bin [--compare-only]
+
+def get_geometry(com):
+    com.write(b"\x05" + b"\x00" * 4)
+    config, page_size, spare_size, block_size, pages_in_block, total_pages, meta_type, is_emmc = struct.unpack("<6IBB", com.read(26))
+    return page_size + spare_size, pages_in_block, is_emmc
+
+def get_block_crcs(com, first, count):
+    com.write(struct.pack("<BII", 0x0A, first, count))
+    crcs = []
+    for i in range(count):
+        status, crc = struct.unpack("<II", com.read(8))
+        crcs.append(None if status else crc)
+    return crcs
+
+def write_pages(com, lba, pages):
+    com.write(struct.pack("<BII", 0x06, lba, len(pages)))
+    for page in pages:
+        com.write(page)
+    errors = []
+    done = 0
+    while done < len(pages):
+        first, count = struct.unpack("<II", com.read(8))
+        statuses = struct.unpack("<%dI" % count, com.read(4 * count))
+        for i, status in enumerate(statuses):
+            if status:
+                errors.append((first + i, status))
+        done += count
+    return errors
+
+def stop_smc(com):
+    com.write(b"\xC1" + b"\x00" * 4)
+
+def start_smc(com):
+    com.write(b"\xC0" + b"\x00" * 4)
+
+if __name__ == "__main__":
+    image = open(sys.argv[1], "rb").read()
+    compare_only = "--compare-only" in sys.argv
+
+    port = serial.tools.list_ports.comports()[0]
+    com = serial.Serial(port.device)
+    stop_smc(com)
+
+    page_len, pages_in_block, is_emmc = get_geometry(com)
+    if is_emmc:
+        print("eMMC console, use the eMMC tools")
+        sys.exit(1)
+
+    block_len = page_len * pages_in_block
+    blocks = len(image) // block_len
+
+    crcs = get_block_crcs(com, 0, blocks)
+    changed = [i for i in range(blocks) if crcs[i] != zlib.crc32(image[i * block_len:(i + 1) * block_len])]
+    print("%d of %d blocks differ" % (len(changed), blocks))
+
+    if not compare_only:
+        for block in changed:
+            data = image[block * block_len:(block + 1) * block_len]
+            pages = [data[i:i + page_len] for i in range(0, block_len, page_len)]
+            for lba, status in write_pages(com, block * pages_in_block, pages):
+                print("page %X write failed: %X" % (lba, status))
+            print("block %X written" % block)
+
+    start_smc(com)
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hash.h"
+
+// Slice-by-4 tables, built in RAM at startup
+static uint32_t crc32_table[4][256];
+
+// Xbox 360 NAND EDC is a reflected 26 bit CRC (poly 0x6954559) over the
+// inverted page bits, fed LSB first
+#define EDC_POLY (0x6954559 >> 1)
+#define EDC_BITS 0x1066
+
+static uint32_t edc_table[256];
+
+void hash_init()
+{
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+		crc32_table[0][i] = crc;
+	}
+
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t edc = i;
+		for (int j = 0; j < 8; j++)
+			edc = (edc >> 1) ^ (edc & 1 ? EDC_POLY : 0);
+		edc_table[i] = edc;
+	}
+
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		for (int k = 1; k < 4; k++)
+			crc32_table[k][i] = (crc32_table[k - 1][i] >> 8) ^ crc32_table[0][crc32_table[k - 1][i] & 0xFF];
+	}
+}
+
+uint32_t __time_critical_func(crc32_update)(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	crc = ~crc;
+
+	while (len && ((uintptr_t)buf & 3))
+	{
+		crc = (crc >> 8) ^ crc32_table[0][(crc ^ *buf++) & 0xFF];
+		len--;
+	}
+
+	while (len >= 4)
+	{
+		crc ^= *(const uint32_t *)buf;
+		crc = crc32_table[3][crc & 0xFF] ^ crc32_table[2][(crc >> 8) & 0xFF] ^
+			  crc32_table[1][(crc >> 16) & 0xFF] ^ crc32_table[0][crc >> 24];
+		buf += 4;
+		len -= 4;
+	}
+
+	while (len--)
+		crc = (crc >> 8) ^ crc32_table[0][(crc ^ *buf++) & 0xFF];
+
+	return ~crc;
+}
+
+uint32_t __time_critical_func(edc_calc)(const uint8_t *page)
+{
+	uint32_t edc = 0;
+
+	int i = 0;
+	for (; i < EDC_BITS / 8; i++)
+		edc = (edc >> 8) ^ edc_table[(edc ^ ~page[i]) & 0xFF];
+
+	uint8_t v = ~page[i];
+	for (int j = 0; j < EDC_BITS % 8; j++, v >>= 1)
+	{
+		edc ^= v & 1;
+		edc = (edc >> 1) ^ (edc & 1 ? EDC_POLY : 0);
+	}
+
+	return ~edc << 6;
+}
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void __time_critical_func(sha1_transform)(uint32_t *state, const uint8_t *block)
+{
+	uint32_t w[16];
+	for (int i = 0; i < 16; i++)
+		w[i] = (block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+	// message schedule is kept in a 16 word ring
+	for (int i = 0; i < 80; i++)
+	{
+		if (i >= 16)
+		{
+			uint32_t t = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15];
+			w[i & 15] = ROL(t, 1);
+		}
+
+		uint32_t f, k;
+		if (i < 20)
+		{
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		}
+		else if (i < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else if (i < 60)
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+
+		uint32_t t = ROL(a, 5) + f + e + k + w[i & 15];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+void sha1_init(sha1_ctx_t *ctx)
+{
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xEFCDAB89;
+	ctx->state[2] = 0x98BADCFE;
+	ctx->state[3] = 0x10325476;
+	ctx->state[4] = 0xC3D2E1F0;
+	ctx->length = 0;
+	ctx->buffered = 0;
+}
+
+void sha1_update(sha1_ctx_t *ctx, const uint8_t *buf, size_t len)
+{
+	ctx->length += len;
+
+	if (ctx->buffered)
+	{
+		size_t n = MIN(len, 64 - ctx->buffered);
+		memcpy(ctx->buffer + ctx->buffered, buf, n);
+		ctx->buffered += n;
+		buf += n;
+		len -= n;
+		if (ctx->buffered < 64)
+			return;
+		sha1_transform(ctx->state, ctx->buffer);
+		ctx->buffered = 0;
+	}
+
+	while (len >= 64)
+	{
+		sha1_transform(ctx->state, buf);
+		buf += 64;
+		len -= 64;
+	}
+
+	memcpy(ctx->buffer, buf, len);
+	ctx->buffered = len;
+}
+
+void sha1_final(sha1_ctx_t *ctx, uint8_t digest[20])
+{
+	uint64_t bits = ctx->length * 8;
+
+	uint8_t pad = 0x80;
+	sha1_update(ctx, &pad, 1);
+	pad = 0;
+	while (ctx->buffered != 56)
+		sha1_update(ctx, &pad, 1);
+
+	uint8_t len[8];
+	for (int i = 0; i < 8; i++)
+		len[i] = bits >> (56 - i * 8);
+	sha1_update(ctx, len, 8);
+
+	for (int i = 0; i < 5; i++)
+	{
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = ctx->state[i] >> 16;
+		digest[i * 4 + 2] = ctx->state[i] >> 8;
+		digest[i * 4 + 3] = ctx->state[i];
+	}
+}
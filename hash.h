@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct
+{
+	uint32_t state[5];
+	uint64_t length;
+	uint8_t buffer[64];
+	uint32_t buffered;
+} sha1_ctx_t;
+
+void hash_init();
+
+// zlib compatible, start with crc = 0
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len);
+
+// EDC of a 0x210 byte NAND page, as stored in the last spare word
+uint32_t edc_calc(const uint8_t *page);
+
+void sha1_init(sha1_ctx_t *ctx);
+void sha1_update(sha1_ctx_t *ctx, const uint8_t *buf, size_t len);
+void sha1_final(sha1_ctx_t *ctx, uint8_t digest[20]);
+
+#endif
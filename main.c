@@ -23,12 +23,16 @@
 #include "hardware/clocks.h"
 #include "pico/stdlib.h"
 #include "pico/bootrom.h"
-#include "pico/util/queue.h"
 #include "pico/multicore.h"
 
 #include "tusb.h"
 #include "xbox.h"
+#include "spiex.h"
+#include "profile.h"
+#include "hash.h"
 #include "isd1200.h"
+#include "usb_io.h"
+#include "ring.h"
 #include "pins.h"
 
 #include "post.pio.h"
@@ -44,6 +48,27 @@
 #define QUEUE_CMD_INIT_EMMC 8
 #define QUEUE_CMD_START_SMC 9
 #define QUEUE_CMD_STOP_SMC 10
+#define QUEUE_CMD_CALIBRATE 11
+#define QUEUE_CMD_GET_GEOMETRY 13
+#define QUEUE_CMD_WRITE_NAND_STREAM 14
+#define QUEUE_CMD_SET_WRITE_FLAGS 15
+#define QUEUE_CMD_GET_WRITE_STATS 16
+#define QUEUE_CMD_HASH_NAND 17
+#define QUEUE_CMD_HASH_EMMC 18
+#define QUEUE_CMD_BLOCK_CRC 19
+#define QUEUE_CMD_SCAN_BAD_BLOCKS 20
+#define QUEUE_CMD_READ_NAND_EX 21
+#define QUEUE_CMD_WRITE_NAND_META 22
+#define QUEUE_CMD_SET_RETRY_POLICY 23
+#define QUEUE_CMD_GET_READ_STATS 24
+#define QUEUE_CMD_GET_BUSY_STATS 25
+#define QUEUE_CMD_READ_EMMC_MULTI 26
+#define QUEUE_CMD_WRITE_EMMC_MULTI 27
+#define QUEUE_CMD_ERASE_EMMC 28
+#define QUEUE_CMD_WRITE_NAND_TAGGED 29
+#define QUEUE_CMD_WRITE_EMMC_TAGGED 30
+#define QUEUE_CMD_GET_EMMC_BUS 31
+#define QUEUE_CMD_RESET_RING_STATS 32
 
 void core1_stop_smc(void);
 void core1_start_smc(void);
@@ -77,22 +102,94 @@ void tud_resume_cb(void)
 	//core1_stop_smc();
 }
 
+// Only this goes through the queues, page data stays in a pool buffer that
+// core1 reads into and writes from directly
 typedef struct
 {
 	uint32_t cmd;
 	uint32_t status;
     uint32_t offset;
-	uint8_t data[0x210];
+	uint32_t flags; // STREAM_FLAG_* for QUEUE_CMD_READ_NAND_EX, sectors left for QUEUE_CMD_*_EMMC_MULTI,
+					// host tag for QUEUE_CMD_*_TAGGED
+	uint8_t *data; // from page_get(), NULL for commands without data
 } queue_entry_t;
 
-queue_t xbox_queue;
-queue_t usb_queue;
+// Commands to core1 and their results back, see ring.h. Streams keep up to
+// the depth of both rings in flight, the page pool has to cover that.
+#define CORE_RING_DEPTH 8
+
+static queue_entry_t xbox_queue_entries[CORE_RING_DEPTH];
+static queue_entry_t usb_queue_entries[CORE_RING_DEPTH];
+ring_t xbox_queue;
+ring_t usb_queue;
+
+// Page buffer pool. Buffers are only handed out and taken back on core0,
+// core1 just uses the one that came with the entry. Streams leave a few
+// buffers for the synchronous commands.
+#define PAGE_POOL_SIZE 24
+#define PAGE_POOL_RESERVE 2
+
+#if PAGE_POOL_SIZE < 2 * CORE_RING_DEPTH + PAGE_POOL_RESERVE
+#error "PAGE_POOL_SIZE too small for CORE_RING_DEPTH"
+#endif
+
+static uint8_t page_pool[PAGE_POOL_SIZE][0x210] __attribute__((aligned(4)));
+static uint8_t *page_free[PAGE_POOL_SIZE];
+static uint32_t page_free_count = 0;
+
+static void page_pool_init()
+{
+	for (int i = 0; i < PAGE_POOL_SIZE; i++)
+		page_free[i] = page_pool[i];
+	page_free_count = PAGE_POOL_SIZE;
+}
+
+static bool page_available()
+{
+	return page_free_count > PAGE_POOL_RESERVE;
+}
+
+static uint8_t *page_get()
+{
+	if (!page_free_count)
+		panic("page pool empty");
+	return page_free[--page_free_count];
+}
+
+static void page_put(uint8_t *page)
+{
+	page_free[page_free_count++] = page;
+}
 
 #define GET_VERSION 0x00
 #define GET_FLASH_CONFIG 0x01
 #define READ_FLASH 0x02
 #define WRITE_FLASH 0x03
 #define READ_FLASH_STREAM 0x04
+#define GET_GEOMETRY 0x05
+#define WRITE_FLASH_STREAM 0x06
+#define SET_WRITE_FLAGS 0x07
+#define GET_WRITE_STATS 0x08
+#define HASH_RANGE 0x09
+#define BLOCK_CRC_MAP 0x0A
+#define SCAN_BAD_BLOCKS 0x0B
+#define READ_FLASH_STREAM_EDC 0x0C
+#define GET_EDC_STATS 0x0D
+#define WRITE_FLASH_STREAM_DATA 0x0E
+#define READ_FLASH_STREAM_EX 0x0F
+#define SET_RETRY_POLICY 0x10
+#define GET_READ_STATS 0x11
+#define GET_BUSY_STATS 0x12
+#define WRITE_FLASH_TAGGED 0x13
+#define GET_WRITE_COMPLETIONS 0x14
+#define GET_RING_STATS 0x15
+
+// READ_FLASH_STREAM_EX flags
+#define STREAM_FLAG_EDC (1 << 0)	// check the spare EDC, see XBOX_STATUS_EDC_ERROR
+#define STREAM_FLAG_ERASED (1 << 1)	// send runs of erased pages as a marker and a count
+#define STREAM_FLAG_CONTINUE (1 << 2)	// a failed page only gets its status, the stream goes on
+
+#define SCAN_BAD_BLOCKS_MAX 2048
 
 #define GET_POST 0x80
 
@@ -104,9 +201,16 @@ queue_t usb_queue;
 #define EMMC_READ 0x55
 #define EMMC_READ_STREAM 0x56
 #define EMMC_WRITE 0x57
+#define EMMC_HASH_RANGE 0x58
+#define EMMC_READ_STREAM_EX 0x59
+#define EMMC_WRITE_STREAM 0x5A
+#define EMMC_ERASE 0x5B
+#define EMMC_WRITE_TAGGED 0x5C
+#define EMMC_GET_BUS 0x5D
 
 #define START_SMC 0xC0
 #define STOP_SMC 0xC1
+#define CALIBRATE 0xC2
 
 #define ISD1200_INIT 0xA0
 #define ISD1200_DEINIT 0xA1
@@ -129,51 +233,306 @@ struct cmd
 #pragma pack(pop)
 
 bool stream_emmc = false;
+uint32_t stream_flags = 0;
 bool do_stream = false;
 uint32_t stream_offset_rcvd = 0;
 uint32_t stream_offset_sent = 0;
 uint32_t stream_end = 0;
+uint32_t stream_erased_run = 0;
+
+// EDC stream counters, kept until the next EDC stream starts
+uint32_t edc_pages_checked = 0;
+uint32_t edc_errors = 0;
+
+// A run of erased pages goes out as XBOX_STATUS_ERASED and the page count
+// in place of the pages themselves
+static void stream_flush_erased()
+{
+	if (stream_erased_run)
+	{
+		uint32_t status = XBOX_STATUS_ERASED;
+		usb_write(&status, 4);
+		usb_write(&stream_erased_run, 4);
+		stream_erased_run = 0;
+	}
+}
+
 void stream()
 {
 	if (do_stream)
 	{
 		if (stream_offset_rcvd >= stream_end)
 		{
+			if (usb_write_available() < 8)
+				return;
+			stream_flush_erased();
 			do_stream = false;
 			return;
 		}
 
-		if (tud_cdc_write_available() < 4 + (stream_emmc ? 0x200 : 0x210))
+		if (usb_write_available() < 8 + 4 + (stream_emmc ? 0x200 : 0x210))
 			return;
 
-		if (do_stream && !queue_is_full(&xbox_queue) && stream_offset_sent < stream_end)
+		if (do_stream && !ring_is_full(&xbox_queue) && stream_offset_sent < stream_end && page_available())
 		{
 			queue_entry_t entry;
+			entry.data = page_get();
 			entry.offset = stream_offset_sent++;
-			entry.cmd = stream_emmc ? QUEUE_CMD_READ_EMMC : QUEUE_CMD_READ_NAND;
-			queue_add_blocking(&xbox_queue, &entry);
+			entry.flags = stream_flags;
+			if (stream_emmc)
+			{
+				entry.flags = stream_end - entry.offset;
+				entry.cmd = QUEUE_CMD_READ_EMMC_MULTI;
+			}
+			else
+				entry.cmd = stream_flags ? QUEUE_CMD_READ_NAND_EX : QUEUE_CMD_READ_NAND;
+			ring_add_blocking(&xbox_queue, &entry);
 		}
-		if (do_stream && !queue_is_empty(&usb_queue))
+		if (do_stream && !ring_is_empty(&usb_queue))
 		{
 			queue_entry_t entry;
-			queue_remove_blocking(&usb_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
 			++stream_offset_rcvd;
-			tud_cdc_write(&entry.status, 4);
-			if (entry.status == 0)
+			if (stream_flags & STREAM_FLAG_EDC)
 			{
-				tud_cdc_write(entry.data, stream_emmc ? 0x200 : 0x210);
-			} else
+				if ((entry.status & ~(XBOX_STATUS_EDC_ERROR | XBOX_STATUS_ERASED)) == 0)
+					++edc_pages_checked;
+				if (entry.status & XBOX_STATUS_EDC_ERROR)
+					++edc_errors;
+			}
+			if (entry.status == XBOX_STATUS_ERASED)
+			{
+				++stream_erased_run;
+				page_put(entry.data);
+				return;
+			}
+			stream_flush_erased();
+			usb_write(&entry.status, 4);
+			// EDC mismatches are flagged, the page is still sent
+			if ((entry.status & ~XBOX_STATUS_EDC_ERROR) == 0)
+			{
+				usb_write(entry.data, stream_emmc ? 0x200 : 0x210);
+			} else if (!(stream_flags & STREAM_FLAG_CONTINUE))
 			{
 				do_stream = false;
 				while (stream_offset_rcvd < stream_offset_sent)
 				{
-					queue_remove_blocking(&usb_queue, &entry);
+					page_put(entry.data);
+					ring_remove_blocking(&usb_queue, &entry);
+					++stream_offset_rcvd;
 				}
 			}
+			page_put(entry.data);
 		}
 	}
 }
 
+// Write stream: the host pushes pages back to back, every
+// WRITE_STREAM_WINDOW pages (and at the end) it gets an ack made of the
+// first lba of the window, the page count and one status per page. An empty
+// stream gets a single ack with a count of 0.
+// In the data only variant a page is just 0x200 bytes, preceded by an
+// xbox_spare_meta_t at the first page and at every erase block start;
+// core1 builds the spare from it. The eMMC variant takes 0x200 byte sectors
+// and writes them with multi-block writes.
+// Pages are gathered a piece at a time, so on the vendor interface a page
+// may be split over frames.
+#define WRITE_STREAM_WINDOW 16
+
+bool do_write_stream = false;
+bool write_stream_emmc = false;
+bool write_stream_data = false;
+uint32_t write_stream_pages_in_block = 0;
+xbox_spare_meta_t write_stream_meta;
+uint32_t write_stream_sent = 0;
+uint32_t write_stream_rcvd = 0;
+uint32_t write_stream_start = 0;
+uint32_t write_stream_end = 0;
+uint32_t write_stream_window[WRITE_STREAM_WINDOW];
+uint32_t write_stream_window_len = 0;
+uint8_t *write_stream_page = NULL; // page being received
+uint32_t write_stream_fill = 0;
+void write_stream()
+{
+	if (do_write_stream)
+	{
+		if (write_stream_window_len == WRITE_STREAM_WINDOW ||
+			(write_stream_window_len && write_stream_rcvd >= write_stream_end))
+		{
+			if (usb_write_available() < 8 + 4 * write_stream_window_len)
+				return;
+
+			uint32_t first = write_stream_start + write_stream_rcvd - write_stream_window_len;
+			usb_write(&first, 4);
+			usb_write(&write_stream_window_len, 4);
+			usb_write(write_stream_window, 4 * write_stream_window_len);
+			usb_write_flush();
+			write_stream_window_len = 0;
+		}
+
+		if (write_stream_rcvd >= write_stream_end)
+		{
+			do_write_stream = false;
+			return;
+		}
+
+		uint32_t lba = write_stream_start + write_stream_sent;
+		uint32_t needed = write_stream_emmc ? 0x200 : 0x210;
+		bool new_meta = false;
+		if (write_stream_data)
+		{
+			new_meta = write_stream_sent == 0 || lba % write_stream_pages_in_block == 0;
+			needed = 0x200 + (new_meta ? sizeof(xbox_spare_meta_t) : 0);
+		}
+
+		if (!write_stream_page && !ring_is_full(&xbox_queue) && write_stream_sent < write_stream_end && page_available())
+		{
+			write_stream_page = page_get();
+			write_stream_fill = 0;
+		}
+		if (write_stream_page && write_stream_fill < needed && usb_available())
+			write_stream_fill += usb_read(write_stream_page + write_stream_fill, needed - write_stream_fill);
+		if (write_stream_page && write_stream_fill == needed)
+		{
+			queue_entry_t entry;
+			entry.data = write_stream_page;
+			entry.offset = lba;
+			++write_stream_sent;
+			write_stream_page = NULL;
+			if (write_stream_emmc)
+			{
+				entry.flags = write_stream_end - write_stream_sent + 1;
+				entry.cmd = QUEUE_CMD_WRITE_EMMC_MULTI;
+			}
+			else if (write_stream_data)
+			{
+				// arrived as meta then data, the spare goes after the data
+				if (new_meta)
+				{
+					memcpy(&write_stream_meta, entry.data, sizeof(xbox_spare_meta_t));
+					memmove(entry.data, entry.data + sizeof(xbox_spare_meta_t), 0x200);
+				}
+				memcpy(entry.data + 0x200, &write_stream_meta, sizeof(xbox_spare_meta_t));
+				entry.cmd = QUEUE_CMD_WRITE_NAND_META;
+			}
+			else
+			{
+				entry.cmd = QUEUE_CMD_WRITE_NAND_STREAM;
+			}
+			ring_add_blocking(&xbox_queue, &entry);
+		}
+		if (!ring_is_empty(&usb_queue))
+		{
+			queue_entry_t entry;
+			ring_remove_blocking(&usb_queue, &entry);
+			write_stream_window[write_stream_window_len++] = entry.status;
+			++write_stream_rcvd;
+			page_put(entry.data);
+		}
+	}
+}
+
+// Block CRC map: one status + CRC32 pair per erase block, streamed like reads
+bool do_crc_map = false;
+uint32_t crc_map_sent = 0;
+uint32_t crc_map_rcvd = 0;
+uint32_t crc_map_start = 0;
+uint32_t crc_map_end = 0;
+void crc_map_stream()
+{
+	if (do_crc_map)
+	{
+		if (crc_map_rcvd >= crc_map_end)
+		{
+			do_crc_map = false;
+			usb_write_flush();
+			return;
+		}
+
+		if (usb_write_available() < 8)
+			return;
+
+		if (!ring_is_full(&xbox_queue) && crc_map_sent < crc_map_end && page_available())
+		{
+			queue_entry_t entry;
+			entry.data = page_get();
+			entry.offset = crc_map_start + crc_map_sent++;
+			entry.cmd = QUEUE_CMD_BLOCK_CRC;
+			ring_add_blocking(&xbox_queue, &entry);
+		}
+		if (!ring_is_empty(&usb_queue))
+		{
+			queue_entry_t entry;
+			ring_remove_blocking(&usb_queue, &entry);
+			++crc_map_rcvd;
+			usb_write(&entry.status, 4);
+			usb_write(entry.data, 4);
+			page_put(entry.data);
+		}
+	}
+}
+
+// Long running core1 commands reply from the main loop so USB keeps being
+// serviced meanwhile. The reply is the status followed by `pending_reply_len`
+// bytes of entry data.
+uint32_t pending_reply_len = 0;
+void pending_reply()
+{
+	if (!pending_reply_len || ring_is_empty(&usb_queue))
+		return;
+
+	if (usb_write_available() < 4 + pending_reply_len)
+		return;
+
+	queue_entry_t entry;
+	ring_remove_blocking(&usb_queue, &entry);
+	if (entry.cmd == QUEUE_CMD_CALIBRATE && entry.status == 0)
+	{
+		profile_t profile;
+		memcpy(&profile.sys_khz, entry.data, 4);
+		memcpy(&profile.spi_freq, entry.data + 4, 4);
+		// core1 runs from flash, it waits in RAM while the sector is rewritten
+		multicore_lockout_start_blocking();
+		profile_save(&profile);
+		multicore_lockout_end_blocking();
+	}
+	usb_write(&entry.status, 4);
+	usb_write(entry.data, pending_reply_len);
+	page_put(entry.data);
+	usb_write_flush();
+	pending_reply_len = 0;
+}
+
+// Tagged writes: WRITE_FLASH_TAGGED / EMMC_WRITE_TAGGED carry a host tag and
+// get no reply, core1 results are collected here as tag + status pairs until
+// the host picks them up with GET_WRITE_COMPLETIONS. New tagged writes are
+// held back while in flight plus collected ones would overflow the ring.
+#define WRITE_COMPLETIONS_MAX 64
+
+typedef struct
+{
+	uint32_t tag;
+	uint32_t status;
+} write_completion_t;
+
+write_completion_t write_completions[WRITE_COMPLETIONS_MAX];
+uint32_t write_completions_put = 0;
+uint32_t write_completions_get = 0;
+uint32_t tagged_writes_in_flight = 0;
+void collect_write_completions()
+{
+	while (tagged_writes_in_flight && !ring_is_empty(&usb_queue))
+	{
+		queue_entry_t entry;
+		ring_remove_blocking(&usb_queue, &entry);
+		write_completion_t *c = &write_completions[write_completions_put++ % WRITE_COMPLETIONS_MAX];
+		c->tag = entry.flags;
+		c->status = entry.status;
+		page_put(entry.data);
+		--tagged_writes_in_flight;
+	}
+}
+
 unsigned char reverse(unsigned char b) 
 {
    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
@@ -200,35 +559,72 @@ void post_buffer()
 	}
 }
 
-// Invoked when CDC interface received data from host
-void tud_cdc_rx_cb(uint8_t itf)
+// Something started by the last command is still using its interface
+static bool usb_busy()
 {
-	(void)itf;
+	return do_stream || do_write_stream || do_crc_map || pending_reply_len || tagged_writes_in_flight ||
+		write_completions_put != write_completions_get;
+}
+
+static void usb_command(uint8_t itf)
+{
+	if (usb_busy() && itf != usb_io_current())
+		return;
+	usb_io_select(itf);
 
-	uint32_t avilable_data = tud_cdc_available();
+	// page data, picked up by write_stream()
+	if (do_write_stream)
+		return;
+
+	// wait for the running command to finish first
+	if (pending_reply_len || do_crc_map)
+		return;
+
+	uint32_t avilable_data = usb_available();
 
 	uint32_t needed_data = sizeof(struct cmd);
 	{
 		uint8_t cmd;
-		tud_cdc_peek(&cmd);
+		usb_peek(&cmd);
+		if (cmd == WRITE_FLASH_TAGGED || cmd == EMMC_WRITE_TAGGED)
+		{
+			if (do_stream || !page_available() ||
+				tagged_writes_in_flight + write_completions_put - write_completions_get >= WRITE_COMPLETIONS_MAX)
+				return;
+		}
+		else if (cmd != GET_WRITE_COMPLETIONS && tagged_writes_in_flight)
+			return; // other commands share the reply queue
 		if (cmd == WRITE_FLASH)
 			needed_data += 0x210;
+		if (cmd == WRITE_FLASH_TAGGED)
+			needed_data += 4 + 0x210;
+		if (cmd == EMMC_WRITE_TAGGED)
+			needed_data += 4 + 0x200;
+		if (cmd == WRITE_FLASH_STREAM || cmd == WRITE_FLASH_STREAM_DATA || cmd == EMMC_WRITE_STREAM || cmd == EMMC_ERASE || cmd == HASH_RANGE || cmd == EMMC_HASH_RANGE || cmd == BLOCK_CRC_MAP ||
+			cmd == SCAN_BAD_BLOCKS || cmd == READ_FLASH_STREAM_EX || cmd == EMMC_READ_STREAM_EX || cmd == SET_RETRY_POLICY)
+			needed_data += 4;
 		if (cmd == ISD1200_WRITE_FLASH)
 			needed_data += 16;
 	}
 
+	if (avilable_data < needed_data && usb_frame_truncated(needed_data))
+	{
+		usb_skip_frame();
+		return;
+	}
+
 	if (avilable_data >= needed_data)
 	{
 		struct cmd cmd;
 
-		uint32_t count = tud_cdc_read(&cmd, sizeof(cmd));
+		uint32_t count = usb_read(&cmd, sizeof(cmd));
 		if (count != sizeof(cmd))
 			return;
 
 		if (cmd.cmd == GET_VERSION)
 		{
 			uint32_t ver = 3;
-			tud_cdc_write(&ver, 4);
+			usb_write(&ver, 4);
 		}
 		else if (cmd.cmd == START_SMC)
 		{
@@ -238,53 +634,268 @@ void tud_cdc_rx_cb(uint8_t itf)
 		{
 			core1_stop_smc();
 		}
+		else if (cmd.cmd == CALIBRATE)
+		{
+			// the sweep takes seconds, the profile is saved by pending_reply()
+			queue_entry_t entry;
+			entry.data = page_get();
+			entry.cmd = QUEUE_CMD_CALIBRATE;
+			ring_add_blocking(&xbox_queue, &entry);
+			pending_reply_len = 8;
+		}
 		else if (cmd.cmd == GET_FLASH_CONFIG)
 		{
 			uint32_t fc = core1_get_config();
-			tud_cdc_write(&fc, 4);
+			usb_write(&fc, 4);
+		}
+		else if (cmd.cmd == GET_GEOMETRY)
+		{
+			queue_entry_t entry;
+			entry.data = page_get();
+			entry.cmd = QUEUE_CMD_GET_GEOMETRY;
+			ring_add_blocking(&xbox_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
+			usb_write(entry.data, sizeof(xbox_flash_geometry_t));
+			page_put(entry.data);
 		}
 		else if (cmd.cmd == READ_FLASH)
 		{
 			queue_entry_t entry;
+			entry.data = page_get();
 			entry.offset = cmd.lba;
 			entry.cmd = QUEUE_CMD_READ_NAND;
-			queue_add_blocking(&xbox_queue, &entry);
-			queue_remove_blocking(&usb_queue, &entry);
-			tud_cdc_write(&entry.status, 4);
+			ring_add_blocking(&xbox_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
+			usb_write(&entry.status, 4);
 			if (entry.status == 0)
-				tud_cdc_write(entry.data, 0x210);
+				usb_write(entry.data, 0x210);
+			page_put(entry.data);
 		}
 		else if (cmd.cmd == WRITE_FLASH)
 		{
 			queue_entry_t entry;
+			entry.data = page_get();
 			entry.offset = cmd.lba;
-			tud_cdc_read(entry.data, 0x210);
+			usb_read(entry.data, 0x210);
 			entry.cmd = QUEUE_CMD_WRITE_NAND;
-			queue_add_blocking(&xbox_queue, &entry);
-			uint32_t ret = 0;	// TODO: add errors processing
-			tud_cdc_write(&ret, 4);
+			ring_add_blocking(&xbox_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
+			usb_write(&entry.status, 4);
+			page_put(entry.data);
 		}
-		else if (cmd.cmd == READ_FLASH_STREAM)
+		else if (cmd.cmd == WRITE_FLASH_TAGGED || cmd.cmd == EMMC_WRITE_TAGGED)
+		{
+			queue_entry_t entry;
+			entry.data = page_get();
+			entry.offset = cmd.lba;
+			usb_read(&entry.flags, 4);
+			if (cmd.cmd == WRITE_FLASH_TAGGED)
+			{
+				usb_read(entry.data, 0x210);
+				entry.cmd = QUEUE_CMD_WRITE_NAND_TAGGED;
+			}
+			else
+			{
+				usb_read(entry.data, 0x200);
+				entry.cmd = QUEUE_CMD_WRITE_EMMC_TAGGED;
+			}
+			++tagged_writes_in_flight;
+			ring_add_blocking(&xbox_queue, &entry);
+		}
+		else if (cmd.cmd == GET_WRITE_COMPLETIONS)
+		{
+			// up to lba completions, 0 for as many as there are
+			uint32_t count = write_completions_put - write_completions_get;
+			if (cmd.lba && count > cmd.lba)
+				count = cmd.lba;
+			uint32_t available = usb_write_available();
+			uint32_t room = available > 4 ? (available - 4) / sizeof(write_completion_t) : 0;
+			if (count > room)
+				count = room;
+			usb_write(&count, 4);
+			for (uint32_t i = 0; i < count; i++)
+			{
+				write_completion_t *c = &write_completions[write_completions_get++ % WRITE_COMPLETIONS_MAX];
+				usb_write(c, sizeof(*c));
+			}
+		}
+		else if (cmd.cmd == READ_FLASH_STREAM || cmd.cmd == READ_FLASH_STREAM_EDC || cmd.cmd == READ_FLASH_STREAM_EX)
 		{
 			stream_emmc = false;
+			stream_flags = 0;
+			if (cmd.cmd == READ_FLASH_STREAM_EDC)
+				stream_flags = STREAM_FLAG_EDC;
+			else if (cmd.cmd == READ_FLASH_STREAM_EX)
+				usb_read(&stream_flags, 4);
+			stream_erased_run = 0;
+			if (stream_flags & STREAM_FLAG_EDC)
+			{
+				edc_pages_checked = 0;
+				edc_errors = 0;
+			}
 			do_stream = true;
 			stream_offset_sent = 0;
 			stream_offset_rcvd = 0;
 			stream_end = cmd.lba;
 		}
+		else if (cmd.cmd == GET_EDC_STATS)
+		{
+			usb_write(&edc_pages_checked, 4);
+			usb_write(&edc_errors, 4);
+		}
+		else if (cmd.cmd == WRITE_FLASH_STREAM || cmd.cmd == WRITE_FLASH_STREAM_DATA || cmd.cmd == EMMC_WRITE_STREAM)
+		{
+			uint32_t count;
+			usb_read(&count, 4);
+			if (!count)
+			{
+				// nothing to write, the final ack is an empty window
+				uint32_t first = cmd.lba;
+				usb_write(&first, 4);
+				usb_write(&count, 4);
+				usb_write_flush();
+				return;
+			}
+			write_stream_emmc = cmd.cmd == EMMC_WRITE_STREAM;
+			write_stream_data = cmd.cmd == WRITE_FLASH_STREAM_DATA;
+			if (write_stream_data)
+			{
+				// block boundaries tell where the host puts the metadata
+				queue_entry_t entry;
+				entry.data = page_get();
+				entry.cmd = QUEUE_CMD_GET_GEOMETRY;
+				ring_add_blocking(&xbox_queue, &entry);
+				ring_remove_blocking(&usb_queue, &entry);
+				xbox_flash_geometry_t geometry;
+				memcpy(&geometry, entry.data, sizeof(geometry));
+				page_put(entry.data);
+				write_stream_pages_in_block = geometry.pages_in_block;
+			}
+			do_write_stream = true;
+			write_stream_sent = 0;
+			write_stream_rcvd = 0;
+			write_stream_window_len = 0;
+			write_stream_start = cmd.lba;
+			write_stream_end = count;
+		}
+		else if (cmd.cmd == SET_WRITE_FLAGS)
+		{
+			queue_entry_t entry;
+			entry.data = NULL;
+			entry.offset = cmd.lba;
+			entry.cmd = QUEUE_CMD_SET_WRITE_FLAGS;
+			ring_add_blocking(&xbox_queue, &entry);
+		}
+		else if (cmd.cmd == GET_WRITE_STATS)
+		{
+			queue_entry_t entry;
+			entry.data = page_get();
+			entry.offset = cmd.lba; // non-zero resets the counters
+			entry.cmd = QUEUE_CMD_GET_WRITE_STATS;
+			ring_add_blocking(&xbox_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
+			usb_write(entry.data, sizeof(xbox_write_stats_t));
+			page_put(entry.data);
+		}
+		else if (cmd.cmd == GET_RING_STATS)
+		{
+			// read right here, the counters live in shared memory
+			ring_stats_t stats[2];
+			ring_get_stats(&xbox_queue, &stats[0]);
+			ring_get_stats(&usb_queue, &stats[1]);
+			if (cmd.lba) // non-zero resets the counters
+			{
+				// core1 clears the ones it writes itself
+				ring_reset_producer_stats(&xbox_queue);
+				ring_reset_consumer_stats(&usb_queue);
+				queue_entry_t entry;
+				entry.data = NULL;
+				entry.cmd = QUEUE_CMD_RESET_RING_STATS;
+				ring_add_blocking(&xbox_queue, &entry);
+			}
+			usb_write(stats, sizeof(stats));
+		}
+		else if (cmd.cmd == SET_RETRY_POLICY)
+		{
+			queue_entry_t entry;
+			entry.data = NULL;
+			entry.offset = cmd.lba; // retries
+			usb_read(&entry.flags, 4); // backoff_us
+			entry.cmd = QUEUE_CMD_SET_RETRY_POLICY;
+			ring_add_blocking(&xbox_queue, &entry);
+		}
+		else if (cmd.cmd == GET_READ_STATS)
+		{
+			queue_entry_t entry;
+			entry.data = page_get();
+			entry.offset = cmd.lba; // non-zero resets the counters
+			entry.cmd = QUEUE_CMD_GET_READ_STATS;
+			ring_add_blocking(&xbox_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
+			usb_write(entry.data, sizeof(xbox_read_stats_t));
+			page_put(entry.data);
+		}
+		else if (cmd.cmd == GET_BUSY_STATS)
+		{
+			// read, program and erase, in that order
+			queue_entry_t entry;
+			entry.data = page_get();
+			entry.offset = cmd.lba; // non-zero resets the counters
+			entry.cmd = QUEUE_CMD_GET_BUSY_STATS;
+			ring_add_blocking(&xbox_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
+			usb_write(entry.data, XBOX_NAND_OPS * sizeof(xbox_busy_stats_t));
+			page_put(entry.data);
+		}
+		else if (cmd.cmd == HASH_RANGE || cmd.cmd == EMMC_HASH_RANGE)
+		{
+			queue_entry_t entry;
+			entry.data = page_get();
+			entry.offset = cmd.lba;
+			usb_read(entry.data, 4); // page count
+			entry.cmd = cmd.cmd == HASH_RANGE ? QUEUE_CMD_HASH_NAND : QUEUE_CMD_HASH_EMMC;
+			ring_add_blocking(&xbox_queue, &entry);
+			pending_reply_len = sizeof(xbox_hash_t);
+		}
+		else if (cmd.cmd == BLOCK_CRC_MAP)
+		{
+			uint32_t count;
+			usb_read(&count, 4);
+			do_crc_map = true;
+			crc_map_sent = 0;
+			crc_map_rcvd = 0;
+			crc_map_start = cmd.lba;
+			crc_map_end = count;
+		}
+		else if (cmd.cmd == SCAN_BAD_BLOCKS)
+		{
+			// reply is the block count, then the bad and the ECC error bitmaps,
+			// both need to fit the entry so larger scans are split by the host
+			uint32_t count;
+			usb_read(&count, 4);
+			if (count > SCAN_BAD_BLOCKS_MAX)
+				count = SCAN_BAD_BLOCKS_MAX;
+			queue_entry_t entry;
+			entry.data = page_get();
+			entry.offset = cmd.lba;
+			memcpy(entry.data, &count, 4);
+			entry.cmd = QUEUE_CMD_SCAN_BAD_BLOCKS;
+			ring_add_blocking(&xbox_queue, &entry);
+			pending_reply_len = 4 + 2 * ((count + 7) / 8);
+		}
 		else if (cmd.cmd == GET_POST)
 		{
 			uint8_t len = post_put - post_get;
-			tud_cdc_write(&len, 1);
+			usb_write(&len, 1);
 			if (len != 0)
 			{
 				if (post_get < post_put)
 				{
-					tud_cdc_write(post_buf + post_get, post_put - post_get);
+					usb_write(post_buf + post_get, post_put - post_get);
 				} else
 				{
-					tud_cdc_write(post_buf + post_get, sizeof(post_buf) - post_get);
-					tud_cdc_write(post_buf, post_put);
+					usb_write(post_buf + post_get, sizeof(post_buf) - post_get);
+					usb_write(post_buf, post_put);
 				}
 				post_get = post_put = 0;
 			}
@@ -292,58 +903,58 @@ void tud_cdc_rx_cb(uint8_t itf)
 		if (cmd.cmd == ISD1200_INIT)
 		{
 			uint8_t ret = isd1200_init() ? 0 : 1;
-			tud_cdc_write(&ret, 1);
+			usb_write(&ret, 1);
 		}
 		if (cmd.cmd == ISD1200_DEINIT)
 		{
 			isd1200_deinit();
 			uint8_t ret = 0;
-			tud_cdc_write(&ret, 1);
+			usb_write(&ret, 1);
 		}
 		else if (cmd.cmd == ISD1200_READ_ID)
 		{
 			uint8_t dev_id = isd1200_read_id();
-			tud_cdc_write(&dev_id, 1);
+			usb_write(&dev_id, 1);
 		}
 		else if (cmd.cmd == ISD1200_READ_FLASH)
 		{
 			uint8_t buffer[512];
 			isd1200_flash_read(cmd.lba, buffer);
-			tud_cdc_write(buffer, sizeof(buffer));
+			usb_write(buffer, sizeof(buffer));
 		}
 		if (cmd.cmd == ISD1200_ERASE_FLASH)
 		{
 			isd1200_chip_erase();
 			uint8_t ret = 0;
-			tud_cdc_write(&ret, 1);
+			usb_write(&ret, 1);
 		}
 		else if (cmd.cmd == ISD1200_WRITE_FLASH)
 		{
 			uint8_t buffer[16];
-			uint32_t count = tud_cdc_read(&buffer, sizeof(buffer));
+			uint32_t count = usb_read(&buffer, sizeof(buffer));
 			if (count != sizeof(buffer))
 				return;
 			isd1200_flash_write(cmd.lba, buffer);
 			uint32_t ret = 0;
-			tud_cdc_write(&ret, 4);
+			usb_write(&ret, 4);
 		}
 		else if (cmd.cmd == ISD1200_PLAY_VOICE)
 		{
 			isd1200_play_vp(cmd.lba);
 			uint8_t ret = 0;
-			tud_cdc_write(&ret, 1);
+			usb_write(&ret, 1);
 		}
 		else if (cmd.cmd == ISD1200_EXEC_MACRO)
 		{
 			isd1200_exe_vm(cmd.lba);
 			uint8_t ret = 0;
-			tud_cdc_write(&ret, 1);
+			usb_write(&ret, 1);
 		}
 		if (cmd.cmd == ISD1200_RESET)
 		{
 			isd1200_reset();
 			uint8_t ret = 0;
-			tud_cdc_write(&ret, 1);
+			usb_write(&ret, 1);
 		}
 		else if (cmd.cmd == REBOOT_TO_BOOTLOADER)
 		{
@@ -353,74 +964,121 @@ void tud_cdc_rx_cb(uint8_t itf)
 		{
 			uint32_t fc = core1_get_config();
 			int emmc_detect_result = (fc & 0xF0000000) == 0xC0000000;
-			tud_cdc_write(&emmc_detect_result, 1);
+			usb_write(&emmc_detect_result, 1);
 		}
 		else if (cmd.cmd == EMMC_INIT)
 		{
 			queue_entry_t entry;
+			entry.data = NULL;
+			entry.offset = cmd.lba; // non-zero negotiates bus width and timing
 			entry.cmd = QUEUE_CMD_INIT_EMMC;
-			queue_add_blocking(&xbox_queue, &entry);
-			queue_remove_blocking(&usb_queue, &entry);
-			tud_cdc_write(&entry.status, 4);
+			ring_add_blocking(&xbox_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
+			usb_write(&entry.status, 4);
+		}
+		else if (cmd.cmd == EMMC_GET_BUS)
+		{
+			queue_entry_t entry;
+			entry.data = page_get();
+			entry.cmd = QUEUE_CMD_GET_EMMC_BUS;
+			ring_add_blocking(&xbox_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
+			usb_write(entry.data, sizeof(xbox_emmc_bus_t));
+			page_put(entry.data);
 		}
 		else if (cmd.cmd == EMMC_GET_CID)
 		{
 			queue_entry_t entry;
+			entry.data = page_get();
 			entry.cmd = QUEUE_CMD_READ_CID;
-			queue_add_blocking(&xbox_queue, &entry);
-			queue_remove_blocking(&usb_queue, &entry);
-			tud_cdc_write(entry.data, 16);
+			ring_add_blocking(&xbox_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
+			usb_write(entry.data, 16);
+			page_put(entry.data);
 		}
 		else if (cmd.cmd == EMMC_GET_CSD)
 		{
 			queue_entry_t entry;
+			entry.data = page_get();
 			entry.cmd = QUEUE_CMD_READ_CSD;
-			queue_add_blocking(&xbox_queue, &entry);
-			queue_remove_blocking(&usb_queue, &entry);
-			tud_cdc_write(entry.data, 16);
+			ring_add_blocking(&xbox_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
+			usb_write(entry.data, 16);
+			page_put(entry.data);
 		}
 		else if (cmd.cmd == EMMC_GET_EXT_CSD)
 		{
 			queue_entry_t entry;
+			entry.data = page_get();
 			entry.cmd = QUEUE_CMD_READ_EXT_CSD;
-			queue_add_blocking(&xbox_queue, &entry);
-			queue_remove_blocking(&usb_queue, &entry);
-			tud_cdc_write(entry.data, 0x200);
+			ring_add_blocking(&xbox_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
+			usb_write(entry.data, 0x200);
+			page_put(entry.data);
 		}
 		else if (cmd.cmd == EMMC_READ)
 		{
 			queue_entry_t entry;
+			entry.data = page_get();
 			entry.offset = cmd.lba;
 			entry.cmd = QUEUE_CMD_READ_EMMC;
-			queue_add_blocking(&xbox_queue, &entry);
-			queue_remove_blocking(&usb_queue, &entry);
-			tud_cdc_write(&entry.status, 4);
+			ring_add_blocking(&xbox_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
+			usb_write(&entry.status, 4);
 			if (entry.status == 0)
-				tud_cdc_write(entry.data, 0x200);
+				usb_write(entry.data, 0x200);
+			page_put(entry.data);
 		}
-		else if (cmd.cmd == EMMC_READ_STREAM)
+		else if (cmd.cmd == EMMC_READ_STREAM || cmd.cmd == EMMC_READ_STREAM_EX)
 		{
 			stream_emmc = true;
+			stream_flags = 0;
+			if (cmd.cmd == EMMC_READ_STREAM_EX)
+			{
+				usb_read(&stream_flags, 4);
+				stream_flags &= STREAM_FLAG_CONTINUE;
+			}
+			stream_erased_run = 0;
 			do_stream = true;
 			stream_offset_sent = 0;
 			stream_offset_rcvd = 0;
 			stream_end = cmd.lba;
 		}
+		else if (cmd.cmd == EMMC_ERASE)
+		{
+			// can take a while on large ranges, so the reply is pending
+			queue_entry_t entry;
+			entry.data = page_get();
+			entry.offset = cmd.lba;
+			usb_read(entry.data, 4); // sector count
+			entry.cmd = QUEUE_CMD_ERASE_EMMC;
+			ring_add_blocking(&xbox_queue, &entry);
+			pending_reply_len = 4;
+		}
 		else if (cmd.cmd == EMMC_WRITE)
 		{
 			queue_entry_t entry;
+			entry.data = page_get();
 			entry.offset = cmd.lba;
-			tud_cdc_read(entry.data, 0x200);
+			usb_read(entry.data, 0x200);
 			entry.cmd = QUEUE_CMD_WRITE_EMMC;
-			queue_add_blocking(&xbox_queue, &entry);
-			uint32_t ret = 0;	// TODO: add errors processing
-			tud_cdc_write(&ret, 4);
+			ring_add_blocking(&xbox_queue, &entry);
+			ring_remove_blocking(&usb_queue, &entry);
+			usb_write(&entry.status, 4);
+			page_put(entry.data);
 		}
 
-		tud_cdc_write_flush();
+		usb_write_flush();
 	}
 }
 
+// Invoked when CDC interface received data from host
+void tud_cdc_rx_cb(uint8_t itf)
+{
+	(void)itf;
+	usb_command(USB_ITF_CDC);
+}
+
 void tud_cdc_tx_complete_cb(uint8_t itf)
 {
 	(void)itf;
@@ -429,78 +1087,215 @@ void tud_cdc_tx_complete_cb(uint8_t itf)
 void core1_stop_smc()
 {
 	queue_entry_t entry;
+	entry.data = NULL;
 	entry.cmd = QUEUE_CMD_STOP_SMC;
-	queue_add_blocking(&xbox_queue, &entry);
+	ring_add_blocking(&xbox_queue, &entry);
 }
 
 void core1_start_smc()
 {
 	queue_entry_t entry;
+	entry.data = NULL;
 	entry.cmd = QUEUE_CMD_START_SMC;
-	queue_add_blocking(&xbox_queue, &entry);
+	ring_add_blocking(&xbox_queue, &entry);
 }
 
 uint32_t core1_get_config()
 {
 	queue_entry_t entry;
+	entry.data = NULL;
 	entry.cmd = QUEUE_CMD_GET_CONFIG;
-	queue_add_blocking(&xbox_queue, &entry);
-	queue_remove_blocking(&usb_queue, &entry);
+	ring_add_blocking(&xbox_queue, &entry);
+	ring_remove_blocking(&usb_queue, &entry);
 	return entry.status;
 }
 
+static bool queue_cmd_needs_bus(uint32_t cmd)
+{
+	switch (cmd)
+	{
+	case QUEUE_CMD_START_SMC:
+	case QUEUE_CMD_SET_WRITE_FLAGS:
+	case QUEUE_CMD_GET_WRITE_STATS:
+	case QUEUE_CMD_SET_RETRY_POLICY:
+	case QUEUE_CMD_GET_READ_STATS:
+	case QUEUE_CMD_GET_BUSY_STATS:
+	case QUEUE_CMD_GET_EMMC_BUS:
+	case QUEUE_CMD_RESET_RING_STATS:
+		return false;
+	default:
+		return true;
+	}
+}
+
 void main_core1(void)
 {
+	// lets core0 stop us while it writes the flash, see profile_save()
+	multicore_lockout_victim_init();
+
 	while(1)
 	{
 		queue_entry_t entry;
-		queue_peek_blocking(&xbox_queue, &entry);
+		ring_peek_blocking(&xbox_queue, &entry);
+
+		// Take the bus once per command, register access below does no checks
+		if (queue_cmd_needs_bus(entry.cmd))
+			xbox_bus_acquire();
+
+		// anything else on the bus ends an open multi-block transfer
+		if (entry.cmd != QUEUE_CMD_READ_EMMC_MULTI && entry.cmd != QUEUE_CMD_WRITE_EMMC_MULTI)
+			xbox_emmc_multi_stop();
+
 		if (entry.cmd == QUEUE_CMD_READ_NAND)
 		{
 			entry.status = xbox_nand_read_block(entry.offset, entry.data, entry.data + 0x200);
-			queue_add_blocking(&usb_queue, &entry);
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_READ_NAND_EX)
+		{
+			entry.status = xbox_nand_read_block(entry.offset, entry.data, entry.data + 0x200);
+			if (entry.status == 0 && (entry.flags & STREAM_FLAG_ERASED) && xbox_nand_page_is_erased(entry.data))
+				entry.status = XBOX_STATUS_ERASED;
+			else if (entry.status == 0 && (entry.flags & STREAM_FLAG_EDC) && !xbox_nand_check_edc(entry.data))
+				entry.status = XBOX_STATUS_EDC_ERROR;
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_WRITE_NAND_STREAM)
+		{
+			entry.status = xbox_nand_write_block(entry.offset, entry.data, entry.data + 0x200);
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_WRITE_NAND_META)
+		{
+			xbox_spare_meta_t meta;
+			memcpy(&meta, entry.data + 0x200, sizeof(meta));
+			entry.status = xbox_nand_build_spare(&meta, entry.data);
+			if (entry.status == 0)
+				entry.status = xbox_nand_write_block(entry.offset, entry.data, entry.data + 0x200);
+			ring_add_blocking(&usb_queue, &entry);
 		} else if (entry.cmd == QUEUE_CMD_READ_EMMC)
 		{
 			entry.status = xbox_emmc_read_block(entry.offset, entry.data);
-			queue_add_blocking(&usb_queue, &entry);
-		} else if (entry.cmd == QUEUE_CMD_WRITE_NAND)
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_READ_EMMC_MULTI)
+		{
+			entry.status = xbox_emmc_read_multi(entry.offset, entry.flags, entry.data);
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_WRITE_EMMC_MULTI)
+		{
+			entry.status = xbox_emmc_write_multi(entry.offset, entry.flags, entry.data);
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_ERASE_EMMC)
+		{
+			uint32_t count;
+			memcpy(&count, entry.data, 4);
+			entry.status = xbox_emmc_erase(entry.offset, count);
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_WRITE_NAND || entry.cmd == QUEUE_CMD_WRITE_NAND_TAGGED)
 		{
 			entry.status = xbox_nand_write_block(entry.offset, entry.data, entry.data + 0x200);
-			//queue_add_blocking(&usb_queue, &entry); 	// TODO: add errors processing
-		} else if (entry.cmd == QUEUE_CMD_WRITE_EMMC)
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_WRITE_EMMC || entry.cmd == QUEUE_CMD_WRITE_EMMC_TAGGED)
 		{
 			entry.status = xbox_emmc_write_block(entry.offset, entry.data);
-			//queue_add_blocking(&usb_queue, &entry); 	// TODO: add errors processing
+			ring_add_blocking(&usb_queue, &entry);
 		} else if (entry.cmd == QUEUE_CMD_INIT_EMMC)
 		{
-			entry.status = xbox_emmc_init(entry.offset, entry.data);
-			queue_add_blocking(&usb_queue, &entry);
+			entry.status = xbox_emmc_init();
+			if (entry.status == 0 && entry.offset)
+				entry.status = xbox_emmc_negotiate_bus();
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_GET_EMMC_BUS)
+		{
+			memcpy(entry.data, xbox_emmc_get_bus(), sizeof(xbox_emmc_bus_t));
+			ring_add_blocking(&usb_queue, &entry);
 		} else if (entry.cmd == QUEUE_CMD_READ_CID)
 		{
 			entry.status = xbox_emmc_read_cid(entry.data);
-			queue_add_blocking(&usb_queue, &entry);
+			ring_add_blocking(&usb_queue, &entry);
 		} else if (entry.cmd == QUEUE_CMD_READ_CSD)
 		{
 			entry.status = xbox_emmc_read_csd(entry.data);
-			queue_add_blocking(&usb_queue, &entry);
+			ring_add_blocking(&usb_queue, &entry);
 		} else if (entry.cmd == QUEUE_CMD_READ_EXT_CSD)
 		{
 			entry.status = xbox_emmc_read_ext_csd(entry.data);
-			queue_add_blocking(&usb_queue, &entry);
+			ring_add_blocking(&usb_queue, &entry);
 		} else if (entry.cmd == QUEUE_CMD_GET_CONFIG)
 		{
 			entry.status = xbox_get_flash_config();
-			queue_add_blocking(&usb_queue, &entry);
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_GET_GEOMETRY)
+		{
+			memcpy(entry.data, xbox_get_geometry(), sizeof(xbox_flash_geometry_t));
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_SET_WRITE_FLAGS)
+		{
+			xbox_set_write_flags(entry.offset);
+		} else if (entry.cmd == QUEUE_CMD_RESET_RING_STATS)
+		{
+			ring_reset_consumer_stats(&xbox_queue);
+			ring_reset_producer_stats(&usb_queue);
+		} else if (entry.cmd == QUEUE_CMD_GET_WRITE_STATS)
+		{
+			memcpy(entry.data, xbox_get_write_stats(), sizeof(xbox_write_stats_t));
+			if (entry.offset)
+				xbox_reset_write_stats();
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_SET_RETRY_POLICY)
+		{
+			xbox_retry_policy_t policy;
+			policy.retries = entry.offset;
+			policy.backoff_us = entry.flags;
+			xbox_set_retry_policy(&policy);
+		} else if (entry.cmd == QUEUE_CMD_GET_READ_STATS)
+		{
+			memcpy(entry.data, xbox_get_read_stats(), sizeof(xbox_read_stats_t));
+			if (entry.offset)
+				xbox_reset_read_stats();
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_GET_BUSY_STATS)
+		{
+			memcpy(entry.data, xbox_get_busy_stats(), XBOX_NAND_OPS * sizeof(xbox_busy_stats_t));
+			if (entry.offset)
+				xbox_reset_busy_stats();
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_HASH_NAND || entry.cmd == QUEUE_CMD_HASH_EMMC)
+		{
+			uint32_t count;
+			memcpy(&count, entry.data, 4);
+			xbox_hash_t hash;
+			entry.status = xbox_hash_range(entry.offset, count, entry.cmd == QUEUE_CMD_HASH_EMMC, &hash);
+			memcpy(entry.data, &hash, sizeof(hash));
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_BLOCK_CRC)
+		{
+			uint32_t crc = 0;
+			entry.status = xbox_block_crc(entry.offset, &crc);
+			memcpy(entry.data, &crc, 4);
+			ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_SCAN_BAD_BLOCKS)
+		{
+			uint32_t count;
+			memcpy(&count, entry.data, 4);
+			uint8_t *bad = entry.data + 4;
+			uint8_t *ecc = bad + (count + 7) / 8;
+			entry.status = xbox_nand_scan_bad_blocks(entry.offset, count, bad, ecc);
+			ring_add_blocking(&usb_queue, &entry);
 		} else if (entry.cmd == QUEUE_CMD_START_SMC)
 		{
-			xbox_start_smc();
-			//queue_add_blocking(&usb_queue, &entry);
+			xbox_bus_release();
+			//ring_add_blocking(&usb_queue, &entry);
 		} else if (entry.cmd == QUEUE_CMD_STOP_SMC)
 		{
-			xbox_stop_smc();
-			//queue_add_blocking(&usb_queue, &entry);
+			// bus is already acquired above
+			//ring_add_blocking(&usb_queue, &entry);
+		} else if (entry.cmd == QUEUE_CMD_CALIBRATE)
+		{
+			uint32_t sys_khz = 0, spi_freq = 0;
+			entry.status = xbox_calibrate(&sys_khz, &spi_freq);
+			memcpy(entry.data, &sys_khz, 4);
+			memcpy(entry.data + 4, &spi_freq, 4);
+			ring_add_blocking(&usb_queue, &entry);
 		}
-		queue_remove_blocking(&xbox_queue, &entry);
+		ring_remove_blocking(&xbox_queue, &entry);
 	}
 }
 
@@ -523,18 +1318,28 @@ int post_init()
 
 int main(void)
 {
+	uint32_t sys_khz = 166000;
+	profile_t profile;
+	if (profile_load(&profile))
+	{
+		sys_khz = profile.sys_khz;
+		spiex_set_freq(profile.spi_freq);
+	}
+
 	vreg_set_voltage(VREG_VOLTAGE_1_15);
-	set_sys_clock_khz(166000, true);
+	set_sys_clock_khz(sys_khz, true);
 
 	uint32_t freq = clock_get_hz(clk_sys);
 	clock_configure(clk_peri, 0, CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLK_SYS, freq, freq);
 
 	xbox_init();
+	hash_init();
 	tusb_init();
 	post_init();
 
-	queue_init(&xbox_queue, sizeof(queue_entry_t), 8);
-    queue_init(&usb_queue, sizeof(queue_entry_t), 8);
+	page_pool_init();
+	ring_init(&xbox_queue, xbox_queue_entries, sizeof(queue_entry_t), CORE_RING_DEPTH);
+	ring_init(&usb_queue, usb_queue_entries, sizeof(queue_entry_t), CORE_RING_DEPTH);
 
 	multicore_launch_core1(main_core1);
 
@@ -543,6 +1348,17 @@ int main(void)
 		post_buffer();
 		tud_task();
 		stream();
+		write_stream();
+		crc_map_stream();
+		pending_reply();
+		collect_write_completions();
+
+		// commands held back while an earlier one was running, and the
+		// vendor interface, which is only polled
+		if (usb_available_on(USB_ITF_CDC))
+			usb_command(USB_ITF_CDC);
+		if (usb_available_on(USB_ITF_VENDOR))
+			usb_command(USB_ITF_VENDOR);
 	}
 
 	return 0;
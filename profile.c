@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "profile.h"
+
+#define PROFILE_MAGIC 0x52504650 // 'PFPR'
+#define PROFILE_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+
+static uint32_t profile_check(const profile_t *profile)
+{
+	return ~(profile->magic + profile->sys_khz + profile->spi_freq);
+}
+
+bool profile_load(profile_t *profile)
+{
+	memcpy(profile, (const void *)(XIP_BASE + PROFILE_OFFSET), sizeof(*profile));
+
+	if (profile->magic != PROFILE_MAGIC)
+		return false;
+
+	if (profile->check != profile_check(profile))
+		return false;
+
+	return true;
+}
+
+void profile_save(const profile_t *profile)
+{
+	uint8_t page[FLASH_PAGE_SIZE];
+	memset(page, 0xFF, sizeof(page));
+
+	profile_t *p = (profile_t *)page;
+	*p = *profile;
+	p->magic = PROFILE_MAGIC;
+	p->check = profile_check(p);
+
+	uint32_t ints = save_and_disable_interrupts();
+	flash_range_erase(PROFILE_OFFSET, FLASH_SECTOR_SIZE);
+	flash_range_program(PROFILE_OFFSET, page, FLASH_PAGE_SIZE);
+	restore_interrupts(ints);
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Per-console clock profile, kept in the last sector of the Pico's flash
+typedef struct
+{
+	uint32_t magic;
+	uint32_t sys_khz;
+	uint32_t spi_freq;
+	uint32_t check;
+} profile_t;
+
+bool profile_load(profile_t *profile);
+
+// Caller must make sure the other core is not executing from flash
+void profile_save(const profile_t *profile);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+#include "hardware/irq.h"
+
+#include "ring.h"
+
+void ring_init(ring_t *ring, void *storage, uint32_t entry_size, uint32_t depth)
+{
+	if (!depth || (depth & (depth - 1)))
+		panic("ring depth must be a power of two");
+
+	ring->storage = storage;
+	ring->entry_size = entry_size;
+	ring->mask = depth - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	ring_reset_producer_stats(ring);
+	ring_reset_consumer_stats(ring);
+}
+
+uint32_t ring_level(ring_t *ring)
+{
+	return ring->head - ring->tail;
+}
+
+bool ring_is_empty(ring_t *ring)
+{
+	return ring->head == ring->tail;
+}
+
+bool ring_is_full(ring_t *ring)
+{
+	return ring_level(ring) > ring->mask;
+}
+
+// A full FIFO already holds a doorbell the other core has not seen yet.
+// The FIFO write sets the event flag, so a WFE on the other core returns.
+static void ring_doorbell()
+{
+	if (multicore_fifo_wready())
+		multicore_fifo_push_blocking(0);
+	else
+		__sev();
+}
+
+// The doorbell only says something changed, drain it and check again. An
+// event raised between the check and WFE makes WFE return right away.
+// With a FIFO interrupt handler installed (the multicore lockout victim)
+// the handler owns the FIFO and drains the doorbells itself.
+static void ring_wait()
+{
+	if (!irq_is_enabled(SIO_IRQ_PROC0 + get_core_num()))
+		multicore_fifo_drain();
+	__wfe();
+}
+
+void ring_add_blocking(ring_t *ring, const void *entry)
+{
+	if (ring_is_full(ring))
+	{
+		++ring->full_waits;
+		while (ring_is_full(ring))
+			ring_wait();
+	}
+
+	uint32_t head = ring->head;
+	memcpy(ring->storage + (head & ring->mask) * ring->entry_size, entry, ring->entry_size);
+	// entry must be visible before the index that publishes it
+	__dmb();
+	ring->head = head + 1;
+
+	uint32_t level = head + 1 - ring->tail;
+	if (level > ring->high_water)
+		ring->high_water = level;
+	++ring->added;
+
+	ring_doorbell();
+}
+
+void ring_peek_blocking(ring_t *ring, void *entry)
+{
+	if (ring_is_empty(ring))
+	{
+		++ring->empty_waits;
+		while (ring_is_empty(ring))
+			ring_wait();
+	}
+
+	__dmb();
+	memcpy(entry, ring->storage + (ring->tail & ring->mask) * ring->entry_size, ring->entry_size);
+}
+
+void ring_remove_blocking(ring_t *ring, void *entry)
+{
+	ring_peek_blocking(ring, entry);
+	// slot must be read before the producer may reuse it
+	__dmb();
+	ring->tail = ring->tail + 1;
+
+	ring_doorbell();
+}
+
+void ring_get_stats(ring_t *ring, ring_stats_t *stats)
+{
+	stats->depth = ring->mask + 1;
+	stats->level = ring_level(ring);
+	stats->high_water = ring->high_water;
+	stats->added = ring->added;
+	stats->full_waits = ring->full_waits;
+	stats->empty_waits = ring->empty_waits;
+}
+
+void ring_reset_producer_stats(ring_t *ring)
+{
+	ring->high_water = ring_level(ring);
+	ring->added = 0;
+	ring->full_waits = 0;
+}
+
+void ring_reset_consumer_stats(ring_t *ring)
+{
+	ring->empty_waits = 0;
+}
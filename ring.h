@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Single producer, single consumer ring between the two cores. Each index
+// is only written by one side, so no lock is taken. A change is announced
+// with a doorbell word in the inter-core FIFO, the waiting side sleeps in
+// WFE until one arrives.
+
+#pragma pack(push, 1)
+typedef struct
+{
+	uint32_t depth;
+	uint32_t level; // entries in the ring when the stats were taken
+	uint32_t high_water; // most entries seen in the ring
+	uint32_t added;
+	uint32_t full_waits; // producer found the ring full
+	uint32_t empty_waits; // consumer found the ring empty
+} ring_stats_t;
+#pragma pack(pop)
+
+typedef struct
+{
+	uint8_t *storage;
+	uint32_t entry_size;
+	uint32_t mask;
+	volatile uint32_t head; // producer only
+	volatile uint32_t tail; // consumer only
+	// each one written by one side only
+	uint32_t high_water;
+	uint32_t added;
+	uint32_t full_waits;
+	uint32_t empty_waits;
+} ring_t;
+
+// depth must be a power of two, storage depth * entry_size bytes
+void ring_init(ring_t *ring, void *storage, uint32_t entry_size, uint32_t depth);
+
+bool ring_is_empty(ring_t *ring);
+bool ring_is_full(ring_t *ring);
+uint32_t ring_level(ring_t *ring);
+
+void ring_add_blocking(ring_t *ring, const void *entry);
+void ring_peek_blocking(ring_t *ring, void *entry);
+void ring_remove_blocking(ring_t *ring, void *entry);
+
+void ring_get_stats(ring_t *ring, ring_stats_t *stats);
+// Each side resets only the counters it writes
+void ring_reset_producer_stats(ring_t *ring);
+void ring_reset_consumer_stats(ring_t *ring);
+
+#endif
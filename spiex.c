@@ -15,50 +15,187 @@
  */
 
 #include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
 #include "pins.h"
+#include "spiex.h"
 
-#if 0
-#include "pio_spi.h"
+#ifndef SPIEX_FREQ
+#define SPIEX_FREQ (28 * 1000 * 1000)
+#endif
+
+static uint32_t spiex_freq = SPIEX_FREQ;
+static bool spiex_active = false;
+
+static uint dma_tx;
+static uint dma_rx;
 
-pio_spi_inst_t spi;
+// Pending batch ops, a NULL destination marks a write
+static uint32_t *batch_dst[SPIEX_BATCH_MAX];
+static uint batch_len = 0;
+
+uint32_t spiex_get_freq()
+{
+	return spiex_freq;
+}
+
+#ifdef SPIEX_PIO
+#include "hardware/pio.h"
+#include "spi.pio.h"
+
+#define SPIEX_PIO_INST pio0
+#define SPIEX_PIO_SM 1 // sm 0 is the POST reader
+
+static uint spiex_prog;
+
+static float spiex_clkdiv()
+{
+	// spiex program runs 4 cycles per bit
+	float clkdiv = clock_get_hz(clk_sys) / (4.f * spiex_freq);
+	return clkdiv < 1.f ? 1.f : clkdiv;
+}
 
 void spiex_init()
 {
-	pio_spi_init(&spi, pio0, 0, 18.f, 8, SPI_LSB_FIRST, false, false, SPI_SS_N, SPI_MOSI, SPI_MISO);
+	spiex_prog = pio_add_program(SPIEX_PIO_INST, &spiex_program);
+	pio_gpio_init(SPIEX_PIO_INST, SPI_MISO);
+	gpio_pull_up(SPI_MISO);
+	spiex_program_init(SPIEX_PIO_INST, SPIEX_PIO_SM, spiex_prog, spiex_clkdiv(), SPI_SS_N, SPI_MOSI, SPI_MISO);
+
+	// Batches are streamed through the FIFOs by DMA, paced by the state machine
+	dma_tx = dma_claim_unused_channel(true);
+	dma_rx = dma_claim_unused_channel(true);
+
+	dma_channel_config c = dma_channel_get_default_config(dma_tx);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+	channel_config_set_read_increment(&c, true);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, pio_get_dreq(SPIEX_PIO_INST, SPIEX_PIO_SM, true));
+	dma_channel_configure(dma_tx, &c, &SPIEX_PIO_INST->txf[SPIEX_PIO_SM], NULL, 0, false);
+
+	c = dma_channel_get_default_config(dma_rx);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, true);
+	channel_config_set_dreq(&c, pio_get_dreq(SPIEX_PIO_INST, SPIEX_PIO_SM, false));
+	dma_channel_configure(dma_rx, &c, NULL, &SPIEX_PIO_INST->rxf[SPIEX_PIO_SM], 0, false);
+
+	batch_len = 0;
+	spiex_active = true;
 }
 
 void spiex_deinit()
 {
-	pio_remove_program(spi.pio, &spi_cpha0_cs_program, spi.prog);
+	spiex_active = false;
+
+	dma_channel_abort(dma_tx);
+	dma_channel_abort(dma_rx);
+	dma_channel_unclaim(dma_tx);
+	dma_channel_unclaim(dma_rx);
+
+	pio_sm_set_enabled(SPIEX_PIO_INST, SPIEX_PIO_SM, false);
+	pio_sm_set_pindirs_with_mask(SPIEX_PIO_INST, SPIEX_PIO_SM, 0, (1u << SPI_CLK) | (1u << SPI_MOSI));
+	pio_remove_program(SPIEX_PIO_INST, &spiex_program, spiex_prog);
+
+	gpio_init(SPI_CLK);
+	gpio_init(SPI_MOSI);
+	gpio_init(SPI_MISO);
+
+	gpio_init(SPI_SS_N);
+	gpio_put(SPI_SS_N, 1);
+	gpio_set_dir(SPI_SS_N, GPIO_OUT);
+}
+
+uint32_t spiex_set_freq(uint32_t freq)
+{
+	spiex_freq = freq;
+	float clkdiv = spiex_clkdiv();
+	if (spiex_active)
+		pio_sm_set_clkdiv(SPIEX_PIO_INST, SPIEX_PIO_SM, clkdiv);
+	return clock_get_hz(clk_sys) / (4.f * clkdiv);
 }
 
+// A transaction is 3 TX words and 2 RX words, which fits the 4 deep FIFOs,
+// so single register accesses go straight to the FIFOs without flow control.
+
 uint32_t spiex_read_reg(uint8_t reg)
 {
-	uint8_t txbuf[] = {(reg << 2) | 1, 0xFF, 0x00, 0x00, 0x00, 0x00};
-	uint8_t rxbuf[sizeof(txbuf)];
+	io_wo_32 *txfifo = &SPIEX_PIO_INST->txf[SPIEX_PIO_SM];
+	*txfifo = 48 - 1;
+	*txfifo = ((reg << 2) | 1) | 0xFF00;
+	*txfifo = 0;
 
-	pio_spi_write8_read8_blocking(&spi, txbuf, rxbuf, sizeof(txbuf));
+	uint32_t lo = pio_sm_get_blocking(SPIEX_PIO_INST, SPIEX_PIO_SM);
+	uint32_t hi = pio_sm_get_blocking(SPIEX_PIO_INST, SPIEX_PIO_SM);
 
-	return *(uint32_t *)&rxbuf[2];
+	// data starts at the third byte on the wire
+	return (lo >> 16) | (hi & 0xFFFF0000);
 }
 
 void spiex_write_reg(uint8_t reg, uint32_t val)
 {
-	uint8_t txbuf[] = {(reg << 2) | 2, 0x00, 0x00, 0x00, 0x00};
+	io_wo_32 *txfifo = &SPIEX_PIO_INST->txf[SPIEX_PIO_SM];
+	*txfifo = 40 - 1;
+	*txfifo = ((reg << 2) | 2) | (val << 8);
+	*txfifo = val >> 24;
 
-	*(uint32_t *)&txbuf[1] = val;
+	pio_sm_get_blocking(SPIEX_PIO_INST, SPIEX_PIO_SM);
+	pio_sm_get_blocking(SPIEX_PIO_INST, SPIEX_PIO_SM);
+}
+
+static uint32_t batch_tx[SPIEX_BATCH_MAX * 3];
+static uint32_t batch_rx[SPIEX_BATCH_MAX * 2];
+
+static void spiex_batch_add(uint8_t reg, uint32_t val, uint32_t *dst)
+{
+	if (batch_len == SPIEX_BATCH_MAX)
+		spiex_batch_run();
 
-	pio_spi_write8_blocking(&spi, txbuf, sizeof(txbuf));
+	uint32_t *tx = &batch_tx[batch_len * 3];
+	if (dst)
+	{
+		tx[0] = 48 - 1;
+		tx[1] = ((reg << 2) | 1) | 0xFF00;
+		tx[2] = 0;
+	}
+	else
+	{
+		tx[0] = 40 - 1;
+		tx[1] = ((reg << 2) | 2) | (val << 8);
+		tx[2] = val >> 24;
+	}
+	batch_dst[batch_len++] = dst;
 }
-#endif
-#include "hardware/spi.h"
 
-extern void xbox_stop_smc();
+void spiex_batch_run()
+{
+	if (!batch_len)
+		return;
+
+	// The whole batch goes out as one DMA burst, the state machine toggles CS
+	// between transactions on its own.
+	dma_channel_set_read_addr(dma_tx, batch_tx, false);
+	dma_channel_set_trans_count(dma_tx, batch_len * 3, false);
+	dma_channel_set_write_addr(dma_rx, batch_rx, false);
+	dma_channel_set_trans_count(dma_rx, batch_len * 2, false);
+
+	dma_start_channel_mask((1u << dma_tx) | (1u << dma_rx));
+	dma_channel_wait_for_finish_blocking(dma_rx);
+
+	for (uint i = 0; i < batch_len; i++)
+	{
+		if (batch_dst[i])
+			*batch_dst[i] = (batch_rx[i * 2] >> 16) | (batch_rx[i * 2 + 1] & 0xFFFF0000);
+	}
+
+	batch_len = 0;
+}
+#else
+#include "hardware/spi.h"
 
 void spiex_init()
 {
-	spi_init(spi0, 28 * 1000 * 1000);
-
+	spi_init(spi0, spiex_freq);
 	gpio_set_function(SPI_MISO, GPIO_FUNC_SPI);
 	gpio_pull_up(SPI_MISO);
 	gpio_init(SPI_SS_N);
@@ -68,13 +205,50 @@ void spiex_init()
 	gpio_init(SPI_SS_N);
 	gpio_put(SPI_SS_N, 1);
 	gpio_set_dir(SPI_SS_N, GPIO_OUT);
+
+	// TX channel feeds the SPI FIFO from memory, RX channel drains it back.
+	// Both are paced by the SPI DREQs, so the bus is never starved mid-frame.
+	dma_tx = dma_claim_unused_channel(true);
+	dma_rx = dma_claim_unused_channel(true);
+
+	dma_channel_config c = dma_channel_get_default_config(dma_tx);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_read_increment(&c, true);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, spi_get_dreq(spi0, true));
+	dma_channel_configure(dma_tx, &c, &spi_get_hw(spi0)->dr, NULL, 0, false);
+
+	c = dma_channel_get_default_config(dma_rx);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, true);
+	channel_config_set_dreq(&c, spi_get_dreq(spi0, false));
+	dma_channel_configure(dma_rx, &c, NULL, &spi_get_hw(spi0)->dr, 0, false);
+
+	batch_len = 0;
+	spiex_active = true;
 }
 
 void spiex_deinit()
 {
+	spiex_active = false;
+
+	dma_channel_abort(dma_tx);
+	dma_channel_abort(dma_rx);
+	dma_channel_unclaim(dma_tx);
+	dma_channel_unclaim(dma_rx);
+
 	spi_deinit(spi0);
 }
 
+uint32_t spiex_set_freq(uint32_t freq)
+{
+	spiex_freq = freq;
+	if (spiex_active)
+		return spi_set_baudrate(spi0, freq);
+	return freq;
+}
+
 static uint8_t lsb2msb[] = 
 {
 	0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0, 
@@ -95,20 +269,32 @@ static uint8_t lsb2msb[] =
 	0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef, 0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff, 
 };
 
+// One chip select framed transaction. RX completion implies the last TX byte
+// has been clocked out, so CS can be released as soon as the RX channel is done.
+static void spiex_transfer(const uint8_t *tx, uint8_t *rx, size_t len)
+{
+	dma_channel_set_read_addr(dma_tx, tx, false);
+	dma_channel_set_trans_count(dma_tx, len, false);
+	dma_channel_set_write_addr(dma_rx, rx, false);
+	dma_channel_set_trans_count(dma_rx, len, false);
+
+	gpio_put(SPI_SS_N, 0);
+
+	dma_start_channel_mask((1u << dma_tx) | (1u << dma_rx));
+	dma_channel_wait_for_finish_blocking(dma_rx);
+
+	gpio_put(SPI_SS_N, 1);
+}
+
 uint32_t spiex_read_reg(uint8_t reg)
 {
-	xbox_stop_smc();
 	uint8_t txbuf[] = {(reg << 2) | 1, 0xFF, 0x00, 0x00, 0x00, 0x00};
 	uint8_t rxbuf[sizeof(txbuf)];
 
 	for (int i = 0; i < sizeof(txbuf); i++)
 		txbuf[i] = lsb2msb[txbuf[i]];
 
-	gpio_put(SPI_SS_N, 0);
-
-	spi_write_read_blocking(spi0, txbuf, rxbuf, sizeof(txbuf));
-
-	gpio_put(SPI_SS_N, 1);
+	spiex_transfer(txbuf, rxbuf, sizeof(txbuf));
 
 	for (int i = 0; i < sizeof(rxbuf); i++)
 		rxbuf[i] = lsb2msb[rxbuf[i]];
@@ -118,17 +304,73 @@ uint32_t spiex_read_reg(uint8_t reg)
 
 void spiex_write_reg(uint8_t reg, uint32_t val)
 {
-	xbox_stop_smc();
 	uint8_t txbuf[] = {(reg << 2) | 2, 0x00, 0x00, 0x00, 0x00};
+	uint8_t rxbuf[sizeof(txbuf)];
 
 	*(uint32_t *)&txbuf[1] = val;
 
 	for (int i = 0; i < sizeof(txbuf); i++)
 		txbuf[i] = lsb2msb[txbuf[i]];
 
-	gpio_put(SPI_SS_N, 0);
+	spiex_transfer(txbuf, rxbuf, sizeof(txbuf));
+}
 
-	spi_write_blocking(spi0, txbuf, sizeof(txbuf));
+// Every op gets a 6 byte slot, writes only use the first 5
+static uint8_t batch_tx[SPIEX_BATCH_MAX * 6];
+static uint8_t batch_rx[SPIEX_BATCH_MAX * 6];
 
-	gpio_put(SPI_SS_N, 1);
+static void spiex_batch_add(uint8_t reg, uint32_t val, uint32_t *dst)
+{
+	if (batch_len == SPIEX_BATCH_MAX)
+		spiex_batch_run();
+
+	uint8_t *tx = &batch_tx[batch_len * 6];
+	if (dst)
+	{
+		tx[0] = lsb2msb[(reg << 2) | 1];
+		tx[1] = lsb2msb[0xFF];
+		tx[2] = tx[3] = tx[4] = tx[5] = 0;
+	}
+	else
+	{
+		tx[0] = lsb2msb[(reg << 2) | 2];
+		tx[1] = lsb2msb[val & 0xFF];
+		tx[2] = lsb2msb[(val >> 8) & 0xFF];
+		tx[3] = lsb2msb[(val >> 16) & 0xFF];
+		tx[4] = lsb2msb[val >> 24];
+	}
+	batch_dst[batch_len++] = dst;
+}
+
+void spiex_batch_run()
+{
+	if (!batch_len)
+		return;
+
+	// spi0 can not frame CS per transaction, so each op is its own DMA
+	// transfer out of the packed buffer
+	for (uint i = 0; i < batch_len; i++)
+		spiex_transfer(&batch_tx[i * 6], &batch_rx[i * 6], batch_dst[i] ? 6 : 5);
+
+	for (uint i = 0; i < batch_len; i++)
+	{
+		if (batch_dst[i])
+		{
+			uint8_t *rx = &batch_rx[i * 6];
+			*batch_dst[i] = lsb2msb[rx[2]] | (lsb2msb[rx[3]] << 8) | (lsb2msb[rx[4]] << 16) | (lsb2msb[rx[5]] << 24);
+		}
+	}
+
+	batch_len = 0;
+}
+#endif
+
+void spiex_batch_read(uint8_t reg, uint32_t *dst)
+{
+	spiex_batch_add(reg, 0, dst);
+}
+
+void spiex_batch_write(uint8_t reg, uint32_t val)
+{
+	spiex_batch_add(reg, val, NULL);
 }
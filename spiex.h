@@ -21,8 +21,19 @@
 
 void spiex_init();
 void spiex_deinit();
+uint32_t spiex_set_freq(uint32_t freq);
+uint32_t spiex_get_freq();
 
 uint32_t spiex_read_reg(uint8_t reg);
 void spiex_write_reg(uint8_t reg, uint32_t val);
 
+// Register ops queued with spiex_batch_* are issued back to back by
+// spiex_batch_run(), read results are stored once it returns. A full batch
+// is flushed automatically.
+#define SPIEX_BATCH_MAX 0x110
+
+void spiex_batch_read(uint8_t reg, uint32_t *dst);
+void spiex_batch_write(uint8_t reg, uint32_t val);
+void spiex_batch_run();
+
 #endif
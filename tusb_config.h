@@ -87,7 +87,7 @@ extern "C"
 #define CFG_TUD_MSC 0
 #define CFG_TUD_HID 0
 #define CFG_TUD_MIDI 0
-#define CFG_TUD_VENDOR 0
+#define CFG_TUD_VENDOR 1
 
 // CDC FIFO size of TX and RX
 #define CFG_TUD_CDC_RX_BUFSIZE 1024 * 8
@@ -96,6 +96,10 @@ extern "C"
 // CDC Endpoint transfer buffer size, more is faster
 #define CFG_TUD_CDC_EP_BUFSIZE 1024 * 8
 
+// Vendor FIFO size of TX and RX
+#define CFG_TUD_VENDOR_RX_BUFSIZE 1024 * 8
+#define CFG_TUD_VENDOR_TX_BUFSIZE 1024 * 8
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tusb.h"
+#include "usb_io.h"
+
+static uint8_t usb_itf = USB_ITF_CDC;
+
+// bytes left in the current vendor frame
+static uint32_t vendor_frame_left = 0;
+
+void usb_io_select(uint8_t itf)
+{
+	usb_itf = itf;
+}
+
+uint8_t usb_io_current()
+{
+	return usb_itf;
+}
+
+uint32_t usb_available_on(uint8_t itf)
+{
+	if (itf == USB_ITF_CDC)
+		return tud_cdc_available();
+
+	if (!vendor_frame_left)
+	{
+		if (tud_vendor_available() < 4)
+			return 0;
+		tud_vendor_read(&vendor_frame_left, 4);
+	}
+
+	uint32_t available = tud_vendor_available();
+	return available < vendor_frame_left ? available : vendor_frame_left;
+}
+
+uint32_t usb_available()
+{
+	return usb_available_on(usb_itf);
+}
+
+bool usb_peek(uint8_t *c)
+{
+	if (usb_itf == USB_ITF_CDC)
+		return tud_cdc_peek(c);
+
+	if (!usb_available())
+		return false;
+	return tud_vendor_peek(c);
+}
+
+uint32_t usb_read(void *buf, uint32_t len)
+{
+	if (usb_itf == USB_ITF_CDC)
+		return tud_cdc_read(buf, len);
+
+	uint32_t available = usb_available();
+	if (len > available)
+		len = available;
+	len = tud_vendor_read(buf, len);
+	vendor_frame_left -= len;
+	return len;
+}
+
+uint32_t usb_write(const void *buf, uint32_t len)
+{
+	if (usb_itf == USB_ITF_CDC)
+		return tud_cdc_write(buf, len);
+	return tud_vendor_write(buf, len);
+}
+
+uint32_t usb_write_available()
+{
+	if (usb_itf == USB_ITF_CDC)
+		return tud_cdc_write_available();
+	return tud_vendor_write_available();
+}
+
+void usb_write_flush()
+{
+	if (usb_itf == USB_ITF_CDC)
+		tud_cdc_write_flush();
+	else
+		tud_vendor_write_flush();
+}
+
+bool usb_frame_truncated(uint32_t needed)
+{
+	if (usb_itf != USB_ITF_VENDOR || !vendor_frame_left)
+		return false;
+
+	// the whole frame is here and still too short
+	return vendor_frame_left < needed && tud_vendor_available() >= vendor_frame_left;
+}
+
+void usb_skip_frame()
+{
+	uint8_t buf[64];
+	while (vendor_frame_left)
+	{
+		uint32_t len = vendor_frame_left < sizeof(buf) ? vendor_frame_left : sizeof(buf);
+		len = tud_vendor_read(buf, len);
+		if (!len)
+			break;
+		vendor_frame_left -= len;
+	}
+}
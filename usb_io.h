@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2022 Balázs Triszka <balika011@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USB_IO_H__
+#define __USB_IO_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Commands are accepted on the CDC interface and on the vendor bulk
+// interface, replies go back where the command came from
+#define USB_ITF_CDC 0
+#define USB_ITF_VENDOR 1
+
+void usb_io_select(uint8_t itf);
+uint8_t usb_io_current();
+
+uint32_t usb_available_on(uint8_t itf);
+uint32_t usb_available();
+bool usb_peek(uint8_t *c);
+uint32_t usb_read(void *buf, uint32_t len);
+uint32_t usb_write(const void *buf, uint32_t len);
+uint32_t usb_write_available();
+void usb_write_flush();
+
+// Vendor OUT data comes in frames, a u32 length and that many bytes of
+// commands. A command cut short by the end of its frame is dropped
+// together with the rest of the frame. usb_read() moves on to the next
+// frame by itself, so stream payload read piecewise may span frames.
+bool usb_frame_truncated(uint32_t needed);
+void usb_skip_frame();
+
+#endif
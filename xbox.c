@@ -16,17 +16,72 @@
 
 #include <string.h>
 #include "pico/stdlib.h"
+#include "hardware/clocks.h"
 #include "pins.h"
 #include "spiex.h"
 #include "pio_spi.h"
+#include "xbox.h"
+#include "hash.h"
 
-bool is_selected = false;
-bool is_block_set = false;
+// eMMC card state as far as we know it. Unknown until the first select or
+// deselect, the block length stays set until the card is reinitialized.
+typedef enum
+{
+	EMMC_CARD_UNKNOWN,
+	EMMC_CARD_STANDBY,
+	EMMC_CARD_TRANSFER,
+} emmc_card_state_t;
+
+static emmc_card_state_t emmc_state = EMMC_CARD_UNKNOWN;
+static bool emmc_blocklen_set = false;
+
+// Card registers, read once until the card is reinitialized
+static uint8_t emmc_cid[16];
+static uint8_t emmc_csd[16];
+static uint8_t emmc_ext_csd[0x200];
+static bool emmc_cid_valid = false;
+static bool emmc_csd_valid = false;
+static bool emmc_ext_csd_valid = false;
+
+static void xbox_emmc_forget_card()
+{
+	emmc_state = EMMC_CARD_UNKNOWN;
+	emmc_blocklen_set = false;
+	emmc_cid_valid = false;
+	emmc_csd_valid = false;
+	emmc_ext_csd_valid = false;
+}
+
+// The SPI bus is shared with the SMC, it only becomes ours while the SMC is
+// held in reset. Commands acquire the bus once up front, the register access
+// path in spiex assumes ownership and does no checks of its own.
+typedef enum
+{
+	XBOX_BUS_SMC,
+	XBOX_BUS_OWNED,
+} xbox_bus_state_t;
+
+static xbox_bus_state_t bus_state = XBOX_BUS_SMC;
+
+static xbox_flash_geometry_t geometry;
 
-bool is_smc_running = true;
+static uint32_t write_flags = 0;
+static xbox_write_stats_t write_stats;
+
+static xbox_retry_policy_t retry_policy = {3, 100};
+static xbox_read_stats_t read_stats;
+
+static xbox_busy_stats_t busy_stats[XBOX_NAND_OPS];
+
+// Page sized scratch buffer for reads done on the firmware's own behalf
+static uint8_t page_scratch[0x210];
+
+static void xbox_probe_geometry();
 
 void xbox_init()
 {
+	xbox_reset_busy_stats();
+
 	gpio_init(SMC_DBG_EN);
 	gpio_put(SMC_DBG_EN, 1);
 	gpio_set_dir(SMC_DBG_EN, GPIO_OUT);
@@ -40,9 +95,9 @@ void xbox_init()
 	gpio_set_dir(SPI_SS_N, GPIO_OUT);
 }
 
-void xbox_start_smc()
+void xbox_bus_release()
 {
-	if (is_smc_running)
+	if (bus_state == XBOX_BUS_SMC)
 	{
 		return;
 	}
@@ -55,12 +110,12 @@ void xbox_start_smc()
 	sleep_ms(50);
 
 	gpio_put(SMC_RST_XDK_N, 1);
-	is_smc_running = true;
+	bus_state = XBOX_BUS_SMC;
 }
 
-void xbox_stop_smc()
+void xbox_bus_acquire()
 {
-	if (!is_smc_running)
+	if (bus_state == XBOX_BUS_OWNED)
 	{
 		return;
 	}
@@ -86,22 +141,81 @@ void xbox_stop_smc()
 
 	sleep_ms(200);
 
-	is_selected = false;
-	is_block_set = false;
-	is_smc_running = false;
+	// the SMC may have used the card meanwhile
+	xbox_emmc_forget_card();
+	bus_state = XBOX_BUS_OWNED;
+
+	xbox_probe_geometry();
 }
 
-uint32_t xbox_get_flash_config()
+// Flash sizes by config word, the size bits are not decoded
+static const struct
+{
+	uint32_t config;
+	uint32_t total_pages;
+} known_sizes[] =
+{
+	{0x01198010, 0x8000},	// 16MB small block
+	{0x00023010, 0x8000},	// 16MB big on small (Jasper)
+	{0x00043000, 0x8000},	// 16MB big on small (Trinity, Corona)
+	{0x00AA3020, 0x80000},	// 256MB big block
+	{0x008A3020, 0x100000},	// 512MB big block
+};
+
+static void xbox_probe_geometry()
 {
 	spiex_read_reg(0); // for some reason first ever read may fail
 	uint32_t flash_config = spiex_read_reg(0);
 
+	memset(&geometry, 0, sizeof(geometry));
+	geometry.page_size = 0x200;
+
 	if ((flash_config & 0xF0000000) == 0xC0000000)
 	{
-		flash_config = 0xC0462002;
+		geometry.config = 0xC0462002;
+		geometry.block_size = 0x4000;
+		geometry.pages_in_block = geometry.block_size / geometry.page_size;
+		geometry.meta_type = XBOX_META_NONE;
+		geometry.is_emmc = 1;
+		return;
+	}
+
+	geometry.config = flash_config;
+	geometry.spare_size = 0x10;
+
+	int major = (flash_config >> 17) & 3;
+	int minor = (flash_config >> 4) & 3;
+
+	geometry.block_size = 0x4000;
+	geometry.meta_type = major == 0 ? XBOX_META_SMALL : XBOX_META_BIG_ON_SMALL;
+	if (major >= 1)
+	{
+		if (minor == 2)
+			geometry.block_size = 0x20000;
+		else if (minor == 3)
+			geometry.block_size = 0x40000;
+
+		if (minor >= 2)
+			geometry.meta_type = XBOX_META_BIG;
 	}
 
-	return flash_config;
+	geometry.pages_in_block = geometry.block_size / geometry.page_size;
+
+	for (int i = 0; i < count_of(known_sizes); i++)
+	{
+		if (known_sizes[i].config == flash_config)
+			geometry.total_pages = known_sizes[i].total_pages;
+	}
+}
+
+const xbox_flash_geometry_t *xbox_get_geometry()
+{
+	return &geometry;
+}
+
+uint32_t xbox_get_flash_config()
+{
+	return geometry.config;
 }
 
 uint16_t xbox_nand_get_status()
@@ -114,18 +228,93 @@ void xbox_nand_clear_status()
 	spiex_write_reg(0x04, spiex_read_reg(0x04));
 }
 
-int xbox_nand_wait_ready(uint16_t timeout)
+// Timeouts are in us so they do not depend on the sys and SPI clocks
+#define NAND_TIMEOUT_US 10000
+#define NAND_ERASE_TIMEOUT_US 50000
+
+const xbox_busy_stats_t *xbox_get_busy_stats()
+{
+	return busy_stats;
+}
+
+void xbox_reset_busy_stats()
+{
+	memset(busy_stats, 0, sizeof(busy_stats));
+	for (int i = 0; i < XBOX_NAND_OPS; i++)
+		busy_stats[i].min_us = 0xFFFFFFFF;
+}
+
+static void xbox_busy_record(xbox_busy_stats_t *stats, uint32_t us)
 {
+	stats->count++;
+	stats->total_us += us;
+	if (us < stats->min_us)
+		stats->min_us = us;
+	if (us > stats->max_us)
+		stats->max_us = us;
+
+	// bucket 0 is below 16us, then one bucket per power of two
+	int bucket = 31 - __builtin_clz(us | 1) - 3;
+	if (bucket < 0)
+		bucket = 0;
+	if (bucket >= XBOX_BUSY_BUCKETS)
+		bucket = XBOX_BUSY_BUCKETS - 1;
+	stats->histogram[bucket]++;
+}
+
+// Busy time goes into the stats of op, if given
+static int xbox_nand_wait_ready(uint32_t timeout_us, int op)
+{
+	uint32_t start = time_us_32();
+	uint32_t elapsed;
 	do
 	{
+		elapsed = time_us_32() - start;
 		if (!(xbox_nand_get_status() & 0x01))
+		{
+			if (op != XBOX_NAND_OP_NONE)
+				xbox_busy_record(&busy_stats[op], elapsed);
 			return 0;
-	} while (timeout--);
+		}
+	} while (elapsed < timeout_us);
 
+	if (op != XBOX_NAND_OP_NONE)
+		busy_stats[op].timeouts++;
 	return 1;
 }
 
-int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+void xbox_set_retry_policy(const xbox_retry_policy_t *policy)
+{
+	retry_policy = *policy;
+}
+
+const xbox_read_stats_t *xbox_get_read_stats()
+{
+	return &read_stats;
+}
+
+void xbox_reset_read_stats()
+{
+	memset(&read_stats, 0, sizeof(read_stats));
+}
+
+// Called after a failed attempt, tells whether to try again. The wait
+// grows with every attempt.
+static bool xbox_read_retry(uint32_t attempt)
+{
+	if (attempt >= retry_policy.retries)
+	{
+		read_stats.failures++;
+		return false;
+	}
+
+	read_stats.retries++;
+	if (retry_policy.backoff_us)
+		sleep_us((uint64_t)retry_policy.backoff_us << MIN(attempt, 10));
+	return true;
+}
+
+static int xbox_nand_read_page_once(uint32_t lba, uint8_t *buffer, uint8_t *spare)
 {
 	xbox_nand_clear_status();
 
@@ -133,33 +322,110 @@ int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
 
 	spiex_write_reg(0x08, 0x03);
 
-	if (xbox_nand_wait_ready(0x1000))
+	if (xbox_nand_wait_ready(NAND_TIMEOUT_US, XBOX_NAND_OP_READ))
 	{
 		uint16_t status = xbox_nand_get_status();
-		if (status && !(status & 0x5C)) /* do not stop at bad block / ecc error */
+		if (status && !(status & (XBOX_NAND_STATUS_BB_ER | XBOX_NAND_STATUS_ECC_ER))) /* do not stop at bad block / ecc error */
+		{
+			read_stats.timeouts++;
 			return 0x8000 | status;
+		}
 	}
 
-	spiex_write_reg(0x0C, 0);
+	spiex_batch_write(0x0C, 0);
 
 	uint8_t *end = buffer + 0x200;
 	while (buffer < end)
 	{
-		spiex_write_reg(0x08, 0x00);
+		spiex_batch_write(0x08, 0x00);
 
-		*(uint32_t *) buffer = spiex_read_reg(0x10);
+		spiex_batch_read(0x10, (uint32_t *)buffer);
 		buffer += 4;
 	}
 
 	end = spare + 0x10;
 	while (spare < end)
 	{
-		spiex_write_reg(0x08, 0x00);
+		spiex_batch_write(0x08, 0x00);
 
-		*(uint32_t *)spare = spiex_read_reg(0x10);
+		spiex_batch_read(0x10, (uint32_t *)spare);
 		spare += 4;
 	}
 
+	spiex_batch_run();
+
+	return 0;
+}
+
+int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+{
+	int ret;
+	uint32_t attempt = 0;
+	// every attempt reissues the read command
+	while ((ret = xbox_nand_read_page_once(lba, buffer, spare)) && xbox_read_retry(attempt))
+		attempt++;
+	return ret;
+}
+
+// Same as a page read, but only the spare is pulled out of the controller's
+// page buffer, and the controller status is handed back for inspection
+static int xbox_nand_read_spare(uint32_t lba, uint32_t *spare, uint16_t *status)
+{
+	xbox_nand_clear_status();
+
+	spiex_write_reg(0x0C, lba << 9);
+
+	spiex_write_reg(0x08, 0x03);
+
+	if (xbox_nand_wait_ready(NAND_TIMEOUT_US, XBOX_NAND_OP_READ))
+		return 0x8000 | xbox_nand_get_status();
+
+	*status = xbox_nand_get_status();
+
+	spiex_batch_write(0x0C, 0x200);
+
+	for (int i = 0; i < 4; i++)
+	{
+		spiex_batch_write(0x08, 0x00);
+
+		spiex_batch_read(0x10, &spare[i]);
+	}
+
+	spiex_batch_run();
+
+	return 0;
+}
+
+int xbox_nand_scan_bad_blocks(uint32_t first, uint32_t count, uint8_t *bad, uint8_t *ecc)
+{
+	if (geometry.is_emmc)
+		return 0x8000;
+
+	memset(bad, 0, (count + 7) / 8);
+	memset(ecc, 0, (count + 7) / 8);
+
+	// factory bad block marker position in the spare
+	int marker = geometry.meta_type == XBOX_META_BIG ? 0 : 5;
+
+	for (uint32_t block = 0; block < count; block++)
+	{
+		uint32_t lba = (first + block) * geometry.pages_in_block;
+
+		// marker may be on either of the first two pages
+		for (int page = 0; page < 2; page++)
+		{
+			uint32_t spare[4];
+			uint16_t status = 0;
+			int ret = xbox_nand_read_spare(lba + page, spare, &status);
+
+			if (ret || (status & XBOX_NAND_STATUS_BB_ER) || ((uint8_t *)spare)[marker] != 0xFF)
+				bad[block / 8] |= 1 << (block % 8);
+
+			if (status & XBOX_NAND_STATUS_ECC_ER)
+				ecc[block / 8] |= 1 << (block % 8);
+		}
+	}
+
 	return 0;
 }
 
@@ -175,48 +441,166 @@ int xbox_nand_erase_block(uint32_t lba)
 	spiex_write_reg(0x08, 0x55);
 	spiex_write_reg(0x08, 0x05);
 
-	if (xbox_nand_wait_ready(0x1000))
+	if (xbox_nand_wait_ready(NAND_ERASE_TIMEOUT_US, XBOX_NAND_OP_ERASE))
 		return 0x8000 | xbox_nand_get_status();
 
 	return 0;
 }
 
-int xbox_nand_write_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+void xbox_set_write_flags(uint32_t flags)
 {
-	int flash_config = xbox_get_flash_config();
+	write_flags = flags;
+}
 
-	int major = (flash_config >> 17) & 3;
-	int minor = (flash_config >> 4) & 3;
+const xbox_write_stats_t *xbox_get_write_stats()
+{
+	return &write_stats;
+}
 
-	int blocksize = 0x4000;
-	if (major >= 1)
+void xbox_reset_write_stats()
+{
+	memset(&write_stats, 0, sizeof(write_stats));
+}
+
+static bool is_blank(const uint8_t *buf, size_t len)
+{
+	const uint32_t *p = (const uint32_t *)buf;
+	const uint32_t *end = (const uint32_t *)(buf + len);
+	while (p < end)
 	{
-		if (minor == 2)
-			blocksize = 0x20000;
-		else if (minor == 3)
-			blocksize = 0x40000;
+		if (*p++ != 0xFFFFFFFF)
+			return false;
+	}
+	return true;
+}
+
+bool xbox_nand_page_is_erased(const uint8_t *page)
+{
+	return is_blank(page, 0x210);
+}
+
+bool xbox_nand_check_edc(const uint8_t *page)
+{
+	// erased pages carry no EDC
+	if (is_blank(page, 0x210))
+		return true;
+
+	uint32_t stored;
+	memcpy(&stored, page + 0x20C, 4);
+	return (stored & ~0x3F) == edc_calc(page);
+}
+
+int xbox_nand_build_spare(const xbox_spare_meta_t *meta, uint8_t *page)
+{
+	uint8_t *spare = page + 0x200;
+
+	if (is_blank((const uint8_t *)meta, sizeof(*meta)))
+	{
+		memset(spare, 0xFF, 0x10);
+		return 0;
 	}
 
-	int sectors_in_block = blocksize  / 0x200;
+	memset(spare, 0, 0x10);
+
+	uint8_t id_lo = meta->block_id & 0xFF;
+	uint8_t id_hi = (meta->block_id >> 8) & 0x0F;
+	uint32_t seq = meta->fs_sequence;
 
-	// erase ereases `blocksize` bytes
-	if (lba % sectors_in_block == 0)
+	switch (geometry.meta_type)
 	{
-		int ret = xbox_nand_erase_block(lba);
-		if (ret)
-			return ret;
+	case XBOX_META_SMALL:
+		spare[0] = id_lo;
+		spare[1] = id_hi;
+		spare[2] = seq;
+		spare[3] = seq >> 8;
+		spare[4] = seq >> 16;
+		spare[5] = meta->bad_block;
+		spare[6] = seq >> 24;
+		break;
+	case XBOX_META_BIG_ON_SMALL:
+		spare[0] = seq;
+		spare[1] = id_lo;
+		spare[2] = id_hi;
+		spare[3] = seq >> 8;
+		spare[4] = seq >> 16;
+		spare[5] = meta->bad_block;
+		spare[6] = seq >> 24;
+		break;
+	case XBOX_META_BIG:
+		spare[0] = meta->bad_block;
+		spare[1] = id_lo;
+		spare[2] = id_hi;
+		spare[3] = seq >> 16;
+		spare[4] = seq >> 8;
+		spare[5] = seq;
+		break;
+	default:
+		return 0x8000;
+	}
+
+	// common tail
+	spare[7] = meta->fs_size;
+	spare[8] = meta->fs_size >> 8;
+	spare[9] = meta->fs_page_count;
+	spare[12] = meta->fs_block_type & 0x3F;
+
+	// EDC covers the data, the spare up to here and the block type bits
+	uint32_t edc = edc_calc(page);
+	spare[12] |= edc & 0xC0;
+	spare[13] = edc >> 8;
+	spare[14] = edc >> 16;
+	spare[15] = edc >> 24;
+
+	return 0;
+}
+
+static bool xbox_nand_block_is_blank(uint32_t lba)
+{
+	for (uint32_t i = 0; i < geometry.pages_in_block; i++)
+	{
+		if (xbox_nand_read_block(lba + i, page_scratch, page_scratch + 0x200))
+			return false;
+		if (!is_blank(page_scratch, 0x210))
+			return false;
+	}
+	return true;
+}
+
+static int xbox_nand_program_page(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+{
+	// erase ereases a whole block
+	if (lba % geometry.pages_in_block == 0)
+	{
+		if ((write_flags & XBOX_WRITE_CHECK_BLANK_BLOCK) && xbox_nand_block_is_blank(lba))
+		{
+			write_stats.erases_skipped++;
+		}
+		else
+		{
+			int ret = xbox_nand_erase_block(lba);
+			if (ret)
+				return ret;
+			write_stats.blocks_erased++;
+		}
+	}
+
+	// programming all 0xFF leaves the page as it is
+	if (is_blank(buffer, 0x200) && is_blank(spare, 0x10))
+	{
+		write_stats.pages_skipped++;
+		return 0;
 	}
 
 	xbox_nand_clear_status();
 
-	spiex_write_reg(0x0C, 0);
+	spiex_batch_write(0x0C, 0);
 
 	uint8_t *end = buffer + 0x200;
 	while (buffer < end)
 	{
-		spiex_write_reg(0x10, *(uint32_t *)buffer);
+		spiex_batch_write(0x10, *(uint32_t *)buffer);
 
-		spiex_write_reg(0x08, 0x01);
+		spiex_batch_write(0x08, 0x01);
 
 		buffer += 4;
 	}
@@ -224,31 +608,60 @@ int xbox_nand_write_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
 	end = spare + 0x10;
 	while (spare < end)
 	{
-		spiex_write_reg(0x10, *(uint32_t *)spare);
+		spiex_batch_write(0x10, *(uint32_t *)spare);
 
-		spiex_write_reg(0x08, 0x01);
+		spiex_batch_write(0x08, 0x01);
 
 		spare += 4;
 	}
 
-	if (xbox_nand_wait_ready(0x1000))
+	spiex_batch_run();
+
+	if (xbox_nand_wait_ready(NAND_TIMEOUT_US, XBOX_NAND_OP_NONE))
 		return 0x8000 | xbox_nand_get_status();
 
 	spiex_write_reg(0x0C, lba << 9);
 
-	if (xbox_nand_wait_ready(0x1000))
+	if (xbox_nand_wait_ready(NAND_TIMEOUT_US, XBOX_NAND_OP_NONE))
 		return 0x8000 | xbox_nand_get_status();
 
 	spiex_write_reg(0x08, 0x55);
 	spiex_write_reg(0x08, 0xAA);
 	spiex_write_reg(0x08, 0x04);
 
-	if (xbox_nand_wait_ready(0x1000))
+	if (xbox_nand_wait_ready(NAND_TIMEOUT_US, XBOX_NAND_OP_PROGRAM))
 		return 0x8000 | xbox_nand_get_status();
 
+	write_stats.pages_programmed++;
+
+	return 0;
+}
+
+// Read the page back into the scratch buffer and compare
+static int xbox_nand_verify_page(uint32_t lba, const uint8_t *buffer, const uint8_t *spare)
+{
+	int ret = xbox_nand_read_block(lba, page_scratch, page_scratch + 0x200);
+	if (ret)
+		return ret;
+
+	write_stats.pages_verified++;
+	if (memcmp(page_scratch, buffer, 0x200) || memcmp(page_scratch + 0x200, spare, 0x10))
+	{
+		write_stats.verify_errors++;
+		return XBOX_STATUS_VERIFY_ERROR;
+	}
+
 	return 0;
 }
 
+int xbox_nand_write_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+{
+	int ret = xbox_nand_program_page(lba, buffer, spare);
+	if (ret == 0 && (write_flags & XBOX_WRITE_VERIFY))
+		ret = xbox_nand_verify_page(lba, buffer, spare);
+	return ret;
+}
+
 #define SD_OK (0)
 #define SD_ERR_TIMEOUT (-1)
 #define SD_ERR_BAD_RESPONSE (-2)
@@ -294,8 +707,24 @@ void xbox_emmc_execute(uint32_t reg_4, uint32_t reg_8, uint32_t reg_c)
 	spiex_write_reg(0x0C, reg_c);
 }
 
+static xbox_emmc_bus_t emmc_bus;
+static uint32_t emmc_multi_left;
+
+static int xbox_emmc_switch(uint8_t index, uint8_t value);
+
 int xbox_emmc_init()
 {
+	// The reset below puts the host back to 1 bit at the default clock, the
+	// card has to follow or the next data transfer fails
+	if ((emmc_bus.bus_width && emmc_bus.bus_width != 1) || emmc_bus.hs_timing)
+	{
+		xbox_emmc_switch(183, 0);
+		xbox_emmc_switch(185, 0);
+	}
+
+	memset(&emmc_bus, 0, sizeof(emmc_bus));
+	emmc_multi_left = 0;
+
 	spiex_write_reg(0x2C, spiex_read_reg(0x2C) | (1 << 24));
 	absolute_time_t init_timeout = make_timeout_time_ms(5000);
 	while (!time_reached(init_timeout))
@@ -307,17 +736,16 @@ int xbox_emmc_init()
 	{
 		return SD_ERR_TIMEOUT;
 	}
-	is_selected = false;
-	is_block_set = false;
+	xbox_emmc_forget_card();
 	return SD_OK;
 }
 
 static int xbox_emmc_deselect_card()
 {
 	xbox_emmc_execute(0, 0, 0x7000000);
-	is_selected = false;
-	is_block_set = false;
-	return xbox_emmc_wait_ints(1, 100);
+	int ret = xbox_emmc_wait_ints(1, 100);
+	emmc_state = ret ? EMMC_CARD_UNKNOWN : EMMC_CARD_STANDBY;
+	return ret;
 }
 
 static int xbox_emmc_read_cid_csd(uint8_t * buf, int is_cid)
@@ -326,45 +754,68 @@ static int xbox_emmc_read_cid_csd(uint8_t * buf, int is_cid)
 	int ret = xbox_emmc_wait_ints(1, 100);
 	if (!ret)
 	{
-		for (int i = 0x10; i < 0x20; i += 4)
+		uint32_t data[4];
+		for (int i = 0; i < 4; i++)
+			spiex_batch_read(0x10 + i * 4, &data[i]);
+		spiex_batch_run();
+		memcpy(buf, data, sizeof(data));
+	}
+    return ret;
+}
+
+// CID and CSD can only be read in standby, the card is left there
+static int xbox_emmc_read_cid_csd_cached(uint8_t *buf, int is_cid)
+{
+	uint8_t *cache = is_cid ? emmc_cid : emmc_csd;
+	bool *valid = is_cid ? &emmc_cid_valid : &emmc_csd_valid;
+
+	if (!*valid)
+	{
+		if (emmc_state != EMMC_CARD_STANDBY)
 		{
-			uint32_t data = spiex_read_reg(i);
-			memcpy(buf, &data, 4);
-			buf += 4;
+			xbox_emmc_multi_stop();
+			int ret = xbox_emmc_deselect_card();
+			if (ret)
+				return ret;
 		}
+		int ret = xbox_emmc_read_cid_csd(cache, is_cid);
+		if (ret)
+			return ret;
+		*valid = true;
 	}
-    return ret;
+
+	memcpy(buf, cache, 16);
+	return SD_OK;
 }
 
 int xbox_emmc_read_cid(uint8_t * cid)
 {
-	xbox_emmc_deselect_card();
-	return xbox_emmc_read_cid_csd(cid, 1);
+	return xbox_emmc_read_cid_csd_cached(cid, 1);
 }
 
 int xbox_emmc_read_csd(uint8_t * csd)
 {
-	xbox_emmc_deselect_card();
-	return xbox_emmc_read_cid_csd(csd, 0);
+	return xbox_emmc_read_cid_csd_cached(csd, 0);
 }
 
 static int xbox_emmc_select_card()
 {
-	if (is_selected)
+	if (emmc_state == EMMC_CARD_TRANSFER)
 		return SD_OK;
 	xbox_emmc_execute(0, 0xffff0000, 0x71a0000);
-	is_selected = true;
-	is_block_set = false;
-	return xbox_emmc_wait_ints(1, 100);
+	int ret = xbox_emmc_wait_ints(1, 100);
+	emmc_state = ret ? EMMC_CARD_UNKNOWN : EMMC_CARD_TRANSFER;
+	return ret;
 }
 
 static int xbox_emmc_set_blocklen(int blocklen)
 {
-	if (is_block_set)
+	if (emmc_blocklen_set)
 		return SD_OK;
-	is_block_set = true;
 	xbox_emmc_execute(0x200, blocklen, 0x101a0000);
-	return xbox_emmc_wait_ints(1, 100);
+	int ret = xbox_emmc_wait_ints(1, 100);
+	emmc_blocklen_set = !ret;
+	return ret;
 }
 
 static int xbox_emmc_read_block_ext_csd(uint8_t * buf, int block, int is_block)
@@ -386,23 +837,219 @@ static int xbox_emmc_read_block_ext_csd(uint8_t * buf, int block, int is_block)
 	if (!ret)
 	{
 		for (int i = 0; i < 0x200; i += 4)
-		{
-			uint32_t data = spiex_read_reg(0x20);
-			memcpy(buf + i, &data, 4);
-		}
+			spiex_batch_read(0x20, (uint32_t *)(buf + i));
+		spiex_batch_run();
 	}
 	//xbox_emmc_deselect_card();
 	return ret;
 }
 
+static int xbox_emmc_cache_ext_csd()
+{
+	if (!emmc_ext_csd_valid)
+	{
+		int ret = xbox_emmc_read_block_ext_csd(emmc_ext_csd, 0, 0);
+		if (ret)
+			return ret;
+		emmc_ext_csd_valid = true;
+	}
+
+	return SD_OK;
+}
+
 int xbox_emmc_read_ext_csd(uint8_t *ext_csd)
 {
-	return xbox_emmc_read_block_ext_csd(ext_csd, 0, 0);
+	int ret = xbox_emmc_cache_ext_csd();
+	if (ret)
+		return ret;
+
+	memcpy(ext_csd, emmc_ext_csd, sizeof(emmc_ext_csd));
+	return SD_OK;
 }
 
 int xbox_emmc_read_block(int lba, uint8_t *buf)
 {
-	return xbox_emmc_read_block_ext_csd(buf, lba, 1);
+	int ret;
+	uint32_t attempt = 0;
+	while ((ret = xbox_emmc_read_block_ext_csd(buf, lba, 1)))
+	{
+		if (ret == SD_ERR_TIMEOUT)
+			read_stats.timeouts++;
+		// start over from card selection
+		xbox_emmc_deselect_card();
+		if (!xbox_read_retry(attempt++))
+			break;
+	}
+	return ret;
+}
+
+// Multi-block read and write (CMD18 / CMD25 with a block count and auto
+// CMD12). The transfer stays open across calls as long as they ask for
+// consecutive sectors, each call only moves the next sector through the
+// data port.
+static uint32_t emmc_multi_next;
+static bool emmc_multi_write;
+
+void xbox_emmc_multi_stop()
+{
+	if (!emmc_multi_left)
+		return;
+	emmc_multi_left = 0;
+
+	xbox_emmc_execute(0, 0, 0x0c1b0000); // CMD12
+	xbox_emmc_wait_ints(emmc_multi_write ? 0x03 : 0x01, 1500);
+	// drop what is left in the buffer
+	spiex_write_reg(0x2C, spiex_read_reg(0x2C) | (1 << 26));
+}
+
+int xbox_emmc_read_multi(uint32_t lba, uint32_t count, uint8_t *buf)
+{
+	int ret;
+
+	if (emmc_multi_left && (emmc_multi_write || lba != emmc_multi_next))
+		xbox_emmc_multi_stop();
+
+	if (!emmc_multi_left)
+	{
+		if (count > 0xFFFF)
+			count = 0xFFFF;
+		ret = xbox_emmc_select_card();
+		if (ret)
+			return xbox_emmc_read_block(lba, buf);
+		ret = xbox_emmc_set_blocklen(0x200);
+		if (ret)
+			return xbox_emmc_read_block(lba, buf);
+		xbox_emmc_execute(0x200 | (count << 16), lba << 9, 0x123a0036);
+		ret = xbox_emmc_wait_ints(1, 100);
+		if (ret)
+			return xbox_emmc_read_block(lba, buf);
+		emmc_multi_next = lba;
+		emmc_multi_left = count;
+		emmc_multi_write = false;
+	}
+
+	ret = xbox_emmc_wait_ints(0x20, 1500);
+	if (ret)
+	{
+		// fall back to a single block read, that one retries
+		xbox_emmc_multi_stop();
+		return xbox_emmc_read_block(lba, buf);
+	}
+	xbox_emmc_clear_ints(0x20);
+
+	for (int i = 0; i < 0x200; i += 4)
+		spiex_batch_read(0x20, (uint32_t *)(buf + i));
+	spiex_batch_run();
+
+	emmc_multi_next++;
+	if (--emmc_multi_left == 0)
+		return xbox_emmc_wait_ints(0x02, 1500);
+
+	return SD_OK;
+}
+
+int xbox_emmc_write_multi(uint32_t lba, uint32_t count, uint8_t *buf)
+{
+	int ret;
+
+	if (emmc_multi_left && (!emmc_multi_write || lba != emmc_multi_next))
+		xbox_emmc_multi_stop();
+
+	// verification reads back every sector, that needs single block writes
+	if (write_flags & XBOX_WRITE_VERIFY)
+		return xbox_emmc_write_block(lba, buf);
+
+	if (!emmc_multi_left)
+	{
+		if (count > 0xFFFF)
+			count = 0xFFFF;
+		ret = xbox_emmc_select_card();
+		if (ret)
+			return ret;
+		ret = xbox_emmc_set_blocklen(0x200);
+		if (ret)
+			return ret;
+		xbox_emmc_execute(0x200 | (count << 16), lba << 9, 0x193a0026);
+		ret = xbox_emmc_wait_ints(1, 100);
+		if (ret)
+			return ret;
+		emmc_multi_next = lba;
+		emmc_multi_left = count;
+		emmc_multi_write = true;
+	}
+
+	ret = xbox_emmc_wait_ints(0x10, 1500);
+	if (ret)
+	{
+		xbox_emmc_multi_stop();
+		return ret;
+	}
+	xbox_emmc_clear_ints(0x10);
+
+	for (int i = 0; i < 0x200; i += 4)
+	{
+		uint32_t data;
+		memcpy(&data, buf + i, 4);
+		spiex_batch_write(0x20, data);
+	}
+	spiex_batch_run();
+
+	emmc_multi_next++;
+	// the card is done programming once auto CMD12 completes
+	if (--emmc_multi_left == 0)
+		return xbox_emmc_wait_ints(0x02, 1500);
+
+	return SD_OK;
+}
+
+// EXT_CSD SEC_COUNT, cached with the rest of EXT_CSD
+static int xbox_emmc_sector_count(uint32_t *sectors)
+{
+	int ret = xbox_emmc_cache_ext_csd();
+	if (ret)
+		return ret;
+
+	memcpy(sectors, emmc_ext_csd + 212, 4);
+	return SD_OK;
+}
+
+// TRIM works on write blocks, a plain erase would take the whole erase
+// groups the range touches
+#define EMMC_ERASE_ARG_TRIM 0x00000001
+
+// Erase count sectors from lba (CMD35 / CMD36 / CMD38)
+int xbox_emmc_erase(uint32_t lba, uint32_t count)
+{
+	// addresses are byte addresses, (lba + count) << 9 has to fit
+	if (!count || lba + count < lba || lba + count > (1 << 23))
+		return SD_ERR_BAD_PARAM;
+
+	xbox_emmc_multi_stop();
+
+	uint32_t sectors;
+	int ret = xbox_emmc_sector_count(&sectors);
+	if (ret)
+		return ret;
+	if (sectors && lba + count > sectors)
+		return SD_ERR_BAD_PARAM;
+
+	ret = xbox_emmc_select_card();
+	if (ret)
+		return ret;
+
+	xbox_emmc_execute(0, lba << 9, 0x231a0000);
+	ret = xbox_emmc_wait_ints(1, 100);
+	if (ret)
+		return ret;
+
+	xbox_emmc_execute(0, (lba + count - 1) << 9, 0x241a0000);
+	ret = xbox_emmc_wait_ints(1, 100);
+	if (ret)
+		return ret;
+
+	// R1b, the busy end shows up as transfer complete
+	xbox_emmc_execute(0, EMMC_ERASE_ARG_TRIM, 0x261b0000);
+	return xbox_emmc_wait_ints(0x03, 60000);
 }
 
 int xbox_emmc_write_block(int lba, uint8_t *buf)
@@ -421,10 +1068,328 @@ int xbox_emmc_write_block(int lba, uint8_t *buf)
 		{
 			uint32_t data;
 			memcpy(&data, buf + i, 4);
-			spiex_write_reg(0x20, data);
+			spiex_batch_write(0x20, data);
 		}
+		spiex_batch_run();
 		ret = xbox_emmc_wait_ints(0x12, 1500);
 	}
 	//xbox_emmc_deselect_card();
+
+	if (ret == 0 && (write_flags & XBOX_WRITE_VERIFY))
+	{
+		ret = xbox_emmc_read_block(lba, page_scratch);
+		if (ret)
+			return ret;
+
+		write_stats.pages_verified++;
+		if (memcmp(page_scratch, buf, 0x200))
+		{
+			write_stats.verify_errors++;
+			return XBOX_STATUS_VERIFY_ERROR;
+		}
+	}
+
+	return ret;
+}
+
+const xbox_emmc_bus_t *xbox_emmc_get_bus()
+{
+	return &emmc_bus;
+}
+
+// CMD6 SWITCH, write byte mode
+static int xbox_emmc_switch(uint8_t index, uint8_t value)
+{
+	int ret = xbox_emmc_select_card();
+	if (ret)
+		return ret;
+	xbox_emmc_execute(0, (3 << 24) | (index << 16) | (value << 8), 0x061b0000);
+	return xbox_emmc_wait_ints(0x03, 1000);
+}
+
+static void xbox_emmc_set_host_width(int width)
+{
+	uint32_t ctrl = spiex_read_reg(0x28) & ~0x22;
+	if (width == 8)
+		ctrl |= 0x20;
+	else if (width == 4)
+		ctrl |= 0x02;
+	spiex_write_reg(0x28, ctrl);
+}
+
+static int xbox_emmc_set_host_timing(bool hs, uint8_t div)
+{
+	uint32_t ctrl = spiex_read_reg(0x28) & ~0x04;
+	if (hs)
+		ctrl |= 0x04;
+	spiex_write_reg(0x28, ctrl);
+
+	// the SD clock has to be stopped while the divisor changes
+	uint32_t clk = spiex_read_reg(0x2C) & ~0x07000004;
+	spiex_write_reg(0x2C, clk);
+	clk = (clk & ~0xFF00) | (div << 8);
+	spiex_write_reg(0x2C, clk);
+
+	absolute_time_t timeout = make_timeout_time_ms(10);
+	while (!(spiex_read_reg(0x2C) & 0x02))
+	{
+		if (time_reached(timeout))
+			return SD_ERR_TIMEOUT;
+	}
+	spiex_write_reg(0x2C, clk | 0x04);
+	return SD_OK;
+}
+
+// The properties segment of EXT_CSD has to read back unchanged in the new
+// mode, and the mode bytes have to show what was switched to
+static bool xbox_emmc_check_bus(uint32_t ref, uint8_t bus_width, uint8_t hs_timing)
+{
+	if (xbox_emmc_read_block_ext_csd(page_scratch, 0, 0))
+		return false;
+	return crc32_update(0, page_scratch + 192, 0x200 - 192) == ref &&
+		page_scratch[183] == bus_width && page_scratch[185] == hs_timing;
+}
+
+int xbox_emmc_negotiate_bus()
+{
+	// the mode bytes of EXT_CSD change below
+	emmc_ext_csd_valid = false;
+
+	int ret = xbox_emmc_read_block_ext_csd(page_scratch, 0, 0);
+	if (ret)
+		return ret;
+
+	uint32_t ref = crc32_update(0, page_scratch + 192, 0x200 - 192);
+	uint8_t bus_width = page_scratch[183];
+	uint8_t hs_timing = page_scratch[185];
+	uint8_t div = (spiex_read_reg(0x2C) >> 8) & 0xFF;
+
+	emmc_bus.caps = spiex_read_reg(0x40);
+	emmc_bus.card_type = page_scratch[196];
+	emmc_bus.bus_width = 1;
+	emmc_bus.hs_timing = hs_timing;
+	emmc_bus.clock_div = div;
+
+	// widest first, 8 bit only if the controller has the lines for it
+	static const uint8_t widths[] = {8, 4};
+	bool switched = false;
+	for (int i = 0; i < count_of(widths) && !switched; i++)
+	{
+		uint8_t value = widths[i] == 8 ? 2 : 1;
+		if (widths[i] == 8 && !(emmc_bus.caps & (1 << 18)))
+			continue;
+		if (xbox_emmc_switch(183, value))
+			continue;
+		xbox_emmc_set_host_width(widths[i]);
+		if (xbox_emmc_check_bus(ref, value, hs_timing))
+		{
+			emmc_bus.bus_width = widths[i];
+			bus_width = value;
+			switched = true;
+		}
+	}
+	if (!switched)
+	{
+		xbox_emmc_switch(183, 0);
+		xbox_emmc_set_host_width(1);
+		bus_width = 0;
+	}
+
+	// high speed at twice the clock, if both sides can do it
+	if (!hs_timing && (emmc_bus.card_type & 0x03) && (emmc_bus.caps & (1 << 21)) && div > 1)
+	{
+		if (!xbox_emmc_switch(185, 1))
+		{
+			if (!xbox_emmc_set_host_timing(true, div >> 1) && xbox_emmc_check_bus(ref, bus_width, 1))
+			{
+				emmc_bus.hs_timing = 1;
+				emmc_bus.clock_div = div >> 1;
+			}
+			else
+			{
+				xbox_emmc_set_host_timing(false, div);
+				xbox_emmc_switch(185, 0);
+			}
+		}
+	}
+
+	return xbox_emmc_check_bus(ref, bus_width, emmc_bus.hs_timing) ? SD_OK : SD_ERR_BAD_RESPONSE;
+}
+
+int xbox_hash_range(uint32_t lba, uint32_t count, bool emmc, xbox_hash_t *hash)
+{
+	uint32_t len = emmc ? 0x200 : 0x210;
+	sha1_ctx_t ctx;
+	sha1_init(&ctx);
+
+	int ret = 0;
+	hash->crc32 = 0;
+	for (hash->pages = 0; hash->pages < count; hash->pages++)
+	{
+		if (emmc)
+			ret = xbox_emmc_read_block(lba + hash->pages, page_scratch);
+		else
+			ret = xbox_nand_read_block(lba + hash->pages, page_scratch, page_scratch + 0x200);
+		if (ret)
+			break;
+
+		hash->crc32 = crc32_update(hash->crc32, page_scratch, len);
+		sha1_update(&ctx, page_scratch, len);
+	}
+
+	sha1_final(&ctx, hash->sha1);
 	return ret;
 }
+
+int xbox_block_crc(uint32_t block, uint32_t *crc)
+{
+	uint32_t lba = block * geometry.pages_in_block;
+	uint32_t len = geometry.page_size + geometry.spare_size;
+
+	*crc = 0;
+	for (uint32_t i = 0; i < geometry.pages_in_block; i++)
+	{
+		int ret;
+		if (geometry.is_emmc)
+			ret = xbox_emmc_read_block(lba + i, page_scratch);
+		else
+			ret = xbox_nand_read_block(lba + i, page_scratch, page_scratch + 0x200);
+		if (ret)
+			return ret;
+
+		*crc = crc32_update(*crc, page_scratch, len);
+	}
+	return 0;
+}
+
+// Clock calibration: every sys clock / SPI clock step is checked against
+// reference data read at the slowest SPI clock, and the fastest stable step
+// is backed off by one step for margin.
+
+#define CALIB_ROUNDS 8
+#define CALIB_PAGES 4
+
+static const uint32_t calib_sys_khz[] = {133000, 166000, 200000};
+static const uint32_t calib_spi_freq[] =
+{
+	12000000, 16000000, 20000000, 24000000, 28000000,
+	33000000, 36000000, 40000000, 45000000, 50000000,
+};
+
+static uint32_t calib_checksum(const uint8_t *buf, size_t len)
+{
+	uint32_t hash = 0x811C9DC5;
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ buf[i]) * 0x01000193;
+	return hash;
+}
+
+static int calib_read_page(uint32_t page, bool emmc, uint32_t *checksum)
+{
+	int ret;
+	if (emmc)
+		ret = xbox_emmc_read_block(page, page_scratch);
+	else
+		ret = xbox_nand_read_block(page, page_scratch, page_scratch + 0x200);
+	if (ret)
+		return ret;
+	*checksum = calib_checksum(page_scratch, emmc ? 0x200 : 0x210);
+	return 0;
+}
+
+static bool calib_check(uint32_t config, bool emmc, const uint32_t *ref)
+{
+	spiex_read_reg(0); // first read after a clock change may fail
+	for (int round = 0; round < CALIB_ROUNDS; round++)
+	{
+		if (spiex_read_reg(0) != config)
+			return false;
+
+		for (int page = 0; page < CALIB_PAGES; page++)
+		{
+			uint32_t checksum;
+			if (calib_read_page(page, emmc, &checksum))
+				return false;
+			if (checksum != ref[page])
+				return false;
+		}
+	}
+	return true;
+}
+
+// set_sys_clock_khz() moves clk_peri back to the USB PLL, put it on clk_sys
+// again the way main() does, spi0 rates depend on it
+static bool calib_set_sys_clock(uint32_t khz, bool required)
+{
+	if (!set_sys_clock_khz(khz, required))
+		return false;
+
+	uint32_t freq = clock_get_hz(clk_sys);
+	clock_configure(clk_peri, 0, CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLK_SYS, freq, freq);
+	return true;
+}
+
+int xbox_calibrate(uint32_t *sys_khz, uint32_t *spi_freq)
+{
+	uint32_t cur_sys_khz = clock_get_hz(clk_sys) / 1000;
+	uint32_t cur_spi_freq = spiex_get_freq();
+
+	spiex_set_freq(calib_spi_freq[0]);
+
+	spiex_read_reg(0); // for some reason first ever read may fail
+	uint32_t config = spiex_read_reg(0);
+	bool emmc = (config & 0xF0000000) == 0xC0000000;
+
+	uint32_t ref[CALIB_PAGES];
+	int ret = emmc ? xbox_emmc_init() : 0;
+	for (int page = 0; !ret && page < CALIB_PAGES; page++)
+		ret = calib_read_page(page, emmc, &ref[page]);
+	if (ret)
+	{
+		spiex_set_freq(cur_spi_freq);
+		return ret;
+	}
+
+	uint32_t best_sys_khz = cur_sys_khz;
+	uint32_t best_spi_freq = 0;
+	for (int i = 0; i < count_of(calib_sys_khz); i++)
+	{
+		if (!calib_set_sys_clock(calib_sys_khz[i], false))
+			continue;
+
+		int stable = -1;
+		for (int j = 0; j < count_of(calib_spi_freq); j++)
+		{
+			// stop once the bus can not go any faster at this sys clock
+			uint32_t freq = spiex_set_freq(calib_spi_freq[j]);
+			if (freq < calib_spi_freq[j] - calib_spi_freq[j] / 20)
+				break;
+			if (!calib_check(config, emmc, ref))
+				break;
+			stable = j;
+		}
+		if (stable < 0)
+			continue;
+
+		uint32_t freq = calib_spi_freq[stable > 0 ? stable - 1 : 0];
+		if (freq > best_spi_freq)
+		{
+			best_sys_khz = calib_sys_khz[i];
+			best_spi_freq = freq;
+		}
+	}
+
+	if (!best_spi_freq)
+	{
+		calib_set_sys_clock(cur_sys_khz, true);
+		spiex_set_freq(cur_spi_freq);
+		return 0x8000;
+	}
+
+	calib_set_sys_clock(best_sys_khz, true);
+	spiex_set_freq(best_spi_freq);
+
+	*sys_khz = best_sys_khz;
+	*spi_freq = best_spi_freq;
+	return 0;
+}
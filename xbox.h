@@ -17,21 +17,170 @@
 #ifndef __XBOX_H__
 #define __XBOX_H__
 
+#include <stdint.h>
+#include <stdbool.h>
+
+#define XBOX_META_SMALL 0
+#define XBOX_META_BIG_ON_SMALL 1
+#define XBOX_META_BIG 2
+#define XBOX_META_NONE 0xFF
+
+#pragma pack(push, 1)
+typedef struct
+{
+	uint32_t config;
+	uint32_t page_size;
+	uint32_t spare_size;
+	uint32_t block_size;
+	uint32_t pages_in_block;
+	uint32_t total_pages; // 0 if unknown
+	uint8_t meta_type;
+	uint8_t is_emmc;
+} xbox_flash_geometry_t;
+#pragma pack(pop)
+
+// Logical block metadata, laid out into the spare by xbox_nand_build_spare().
+// All 0xFF leaves the spare erased.
+#pragma pack(push, 1)
+typedef struct
+{
+	uint16_t block_id; // 12 bits
+	uint16_t fs_size;
+	uint32_t fs_sequence; // 24 bits on big block
+	uint8_t fs_page_count;
+	uint8_t fs_block_type; // 6 bits
+	uint8_t bad_block; // 0xFF if good
+	uint8_t reserved;
+} xbox_spare_meta_t;
+#pragma pack(pop)
+
+// NAND controller status register bits
+#define XBOX_NAND_STATUS_ADDR_ER 0x80 // address error
+#define XBOX_NAND_STATUS_BB_ER 0x40 // bad block
+#define XBOX_NAND_STATUS_RNP_ER 0x20
+#define XBOX_NAND_STATUS_ECC_ER 0x1C
+
+// Set on top of the read status when the page spare EDC does not match
+#define XBOX_STATUS_EDC_ERROR 0x10000
+// Read status of an all 0xFF page when erased pages are elided
+#define XBOX_STATUS_ERASED 0x20000
+
+// Write flags
+#define XBOX_WRITE_CHECK_BLANK_BLOCK (1 << 0) // read a block back and skip its erase if it is blank
+#define XBOX_WRITE_VERIFY (1 << 1) // read every written page back and compare it
+
+// Write status of a page that did not read back as written
+#define XBOX_STATUS_VERIFY_ERROR 0x40000
+
+typedef struct
+{
+	uint32_t pages_programmed;
+	uint32_t pages_skipped;
+	uint32_t blocks_erased;
+	uint32_t erases_skipped;
+	uint32_t pages_verified;
+	uint32_t verify_errors;
+} xbox_write_stats_t;
+
+// eMMC bus mode, see xbox_emmc_negotiate_bus()
+#pragma pack(push, 1)
+typedef struct
+{
+	uint32_t caps; // controller capabilities, register 0x40
+	uint8_t card_type; // EXT_CSD DEVICE_TYPE
+	uint8_t bus_width; // 1, 4 or 8, 0 if not negotiated
+	uint8_t hs_timing;
+	uint8_t clock_div; // SD clock divisor
+} xbox_emmc_bus_t;
+#pragma pack(pop)
+
+// Read retries, the wait before a retry is backoff_us << attempt
+#pragma pack(push, 1)
+typedef struct
+{
+	uint32_t retries;
+	uint32_t backoff_us;
+} xbox_retry_policy_t;
+#pragma pack(pop)
+
+typedef struct
+{
+	uint32_t retries;
+	uint32_t timeouts;
+	uint32_t failures; // reads that failed after all retries
+} xbox_read_stats_t;
+
+// NAND busy time, per operation
+#define XBOX_NAND_OP_READ 0
+#define XBOX_NAND_OP_PROGRAM 1
+#define XBOX_NAND_OP_ERASE 2
+#define XBOX_NAND_OPS 3
+#define XBOX_NAND_OP_NONE -1
+
+// Bucket 0 counts waits below 16us, bucket n waits of [8 << n, 16 << n) us,
+// the last one everything above
+#define XBOX_BUSY_BUCKETS 10
+
+#pragma pack(push, 1)
+typedef struct
+{
+	uint32_t count;
+	uint32_t timeouts;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint64_t total_us;
+	uint32_t histogram[XBOX_BUSY_BUCKETS];
+} xbox_busy_stats_t;
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+typedef struct
+{
+	uint32_t pages; // pages hashed before an error, if any
+	uint32_t crc32;
+	uint8_t sha1[20];
+} xbox_hash_t;
+#pragma pack(pop)
+
 void xbox_init();
 
-void xbox_start_smc();
-void xbox_stop_smc();
+void xbox_bus_acquire();
+void xbox_bus_release();
 
 uint32_t xbox_get_flash_config();
+const xbox_flash_geometry_t *xbox_get_geometry();
 int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare);
 int xbox_nand_erase_block(uint32_t lba);
+bool xbox_nand_check_edc(const uint8_t *page);
+bool xbox_nand_page_is_erased(const uint8_t *page);
+int xbox_nand_build_spare(const xbox_spare_meta_t *meta, uint8_t *page);
+int xbox_nand_scan_bad_blocks(uint32_t first, uint32_t count, uint8_t *bad, uint8_t *ecc);
 int xbox_nand_write_block(uint32_t lba, uint8_t *buffer, uint8_t *spare);
+void xbox_set_write_flags(uint32_t flags);
+const xbox_write_stats_t *xbox_get_write_stats();
+void xbox_reset_write_stats();
+void xbox_set_retry_policy(const xbox_retry_policy_t *policy);
+const xbox_read_stats_t *xbox_get_read_stats();
+void xbox_reset_read_stats();
+const xbox_busy_stats_t *xbox_get_busy_stats(); // XBOX_NAND_OPS entries
+void xbox_reset_busy_stats();
 
 int xbox_emmc_init();
+int xbox_emmc_negotiate_bus();
+const xbox_emmc_bus_t *xbox_emmc_get_bus();
 int xbox_emmc_read_cid(uint8_t * cid);
 int xbox_emmc_read_csd(uint8_t * csd);
 int xbox_emmc_read_ext_csd(uint8_t *ext_csd);
 int xbox_emmc_read_block(int lba, uint8_t *buf);
+int xbox_emmc_read_multi(uint32_t lba, uint32_t count, uint8_t *buf);
+int xbox_emmc_write_multi(uint32_t lba, uint32_t count, uint8_t *buf);
+void xbox_emmc_multi_stop();
+int xbox_emmc_erase(uint32_t lba, uint32_t count);
 int xbox_emmc_write_block(int lba, uint8_t *buf);
 
+int xbox_hash_range(uint32_t lba, uint32_t count, bool emmc, xbox_hash_t *hash);
+int xbox_block_crc(uint32_t block, uint32_t *crc);
+
+int xbox_calibrate(uint32_t *sys_khz, uint32_t *spi_freq);
+
 #endif